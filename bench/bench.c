@@ -0,0 +1,187 @@
+/* bench - time utf8conditioner for make bench
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * usage: bench [-r repeat] [-s sets] program file ...
+ *
+ * Runs program on each file with each of the option sets below, or
+ * those given with -s separated by commas (e.g. -s "-c,-x,-X 1.1"), output
+ * and errors to /dev/null, and writes a tab separated line for each:
+ *
+ *   corpus bytes options seconds MB/s bytes/cycle peak_rss_kb status
+ *
+ * The best time of repeat runs (default 3) is given. Cycles are counted
+ * with the time stamp counter where there is one (x86) and so are
+ * reference cycles at the nominal clock rate, elsewhere bytes/cycle
+ * is -. Peak RSS is the largest for any of the runs, it includes the
+ * pages of the mapped input that were touched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define MAX_ARGS 256
+
+/* option sets, -b* is many -b codes spread over the BMP */
+static const char* optionSets[] = {
+  "", "-c", "-x", "-X 1.1", "-m -x", "-e 0 -x", "-b*", NULL
+};
+#define NUM_BAD_CODES 100
+#define MAX_SETS 32
+
+static unsigned long long cycles(void) {
+#ifdef HAVE_TSC
+  return(__rdtsc());
+#else
+  return(0);
+#endif
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return(ts.tv_sec+ts.tv_nsec/1e9);
+}
+
+/* Build argv for program with options set and file */
+static int makeArgs(const char* program, const char* set, const char* file,
+                    char* args[], char* store, size_t size) {
+  int n=0, j;
+  char* tok;
+
+  args[n++]=(char*)program;
+  if (strcmp(set,"-b*")==0) {
+    for (j=0; j<NUM_BAD_CODES; j++) {
+      args[n++]="-b";
+      args[n++]=store;
+      store+=sprintf(store,"0x%X",0xA0+j*641)+1;
+    }
+  } else {
+    strncpy(store,set,size-1);
+    store[size-1]='\0';
+    for (tok=strtok(store," "); tok!=NULL && n<MAX_ARGS-2; tok=strtok(NULL," ")) {
+      args[n++]=tok;
+    }
+  }
+  args[n++]=(char*)file;
+  args[n]=NULL;
+  return(n);
+}
+
+/* Run args once, returns exit status and sets time, cycles and rss */
+static int run(char* args[], double* secs, unsigned long long* cyc, long* rss) {
+  struct rusage ru;
+  int status, fd;
+  pid_t pid;
+  double t;
+  unsigned long long c;
+
+  t=now();
+  c=cycles();
+  if ((pid=fork())<0) {
+    perror("bench: fork");
+    exit(1);
+  }
+  if (pid==0) {
+    if ((fd=open("/dev/null",O_WRONLY))>=0) {
+      dup2(fd,1);
+      dup2(fd,2);
+    }
+    execv(args[0],args);
+    _exit(127);
+  }
+  if (wait4(pid,&status,0,&ru)<0) {
+    perror("bench: wait4");
+    exit(1);
+  }
+  *cyc=cycles()-c;
+  *secs=now()-t;
+  *rss=ru.ru_maxrss;
+  return(WIFEXITED(status) ? WEXITSTATUS(status) : 128+WTERMSIG(status));
+}
+
+int main(int argc, char* argv[]) {
+  int repeat=3;
+  int a=1, s, r, status;
+  const char* sets[MAX_SETS+1];
+  const char** optionSet=optionSets;
+  char* tok;
+  char* args[MAX_ARGS];
+  char store[4096];
+  struct stat st;
+  const char* program;
+  const char* corpus;
+  double secs, best;
+  unsigned long long cyc, bestCyc;
+  long rss, maxRss;
+
+  if (argc>a+1 && strcmp(argv[a],"-r")==0) {
+    repeat=atoi(argv[a+1]);
+    a+=2;
+  }
+  if (argc>a+1 && strcmp(argv[a],"-s")==0) {
+    s=0;
+    for (tok=strtok(argv[a+1],","); tok!=NULL && s<MAX_SETS; tok=strtok(NULL,",")) {
+      sets[s++]=tok;
+    }
+    sets[s]=NULL;
+    optionSet=sets;
+    a+=2;
+  }
+  if (argc<a+2 || repeat<1) {
+    fprintf(stderr,"usage: %s [-r repeat] [-s sets] program file ...\n",argv[0]);
+    exit(1);
+  }
+  program=argv[a];
+  printf("corpus\tbytes\toptions\tseconds\tMB/s\tbytes/cycle\tpeak_rss_kb\tstatus\n");
+  for (a++; a<argc; a++) {
+    if (stat(argv[a],&st)!=0) {
+      perror(argv[a]);
+      exit(1);
+    }
+    corpus=(strrchr(argv[a],'/')!=NULL ? strrchr(argv[a],'/')+1 : argv[a]);
+    for (s=0; optionSet[s]!=NULL; s++) {
+      makeArgs(program,optionSet[s],argv[a],args,store,sizeof(store));
+      best=0;
+      bestCyc=0;
+      maxRss=0;
+      status=0;
+      for (r=0; r<repeat; r++) {
+        status=run(args,&secs,&cyc,&rss);
+        if (r==0 || secs<best) {
+          best=secs;
+          bestCyc=cyc;
+        }
+        if (rss>maxRss) {
+          maxRss=rss;
+        }
+      }
+      printf("%s\t%lld\t%s\t%.6f\t%.1f\t",corpus,(long long)st.st_size,
+             (optionSet[s][0]=='\0' ? "-" : optionSet[s]),best,
+             (best>0 ? st.st_size/best/1e6 : 0.0));
+      if (bestCyc>0) {
+        printf("%.4f",(double)st.st_size/bestCyc);
+      } else {
+        printf("-");
+      }
+      printf("\t%ld\t%d\n",maxRss,status);
+      fflush(stdout);
+    }
+  }
+  return(0);
+}
@@ -0,0 +1,185 @@
+/* mkcorpus - generate test input for make bench
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * usage: mkcorpus type size > file
+ *
+ * Writes size bytes (with K, M or G suffix for multiples of 1024) of
+ * OAI-PMH like XML records of the given type to stdout:
+ *
+ *   ascii      pure ASCII
+ *   cjk        titles in CJK ideographs (3 byte UTF-8)
+ *   latin1-1   1% of letters are Latin-1 bytes, not UTF-8
+ *   latin1-20  20% of letters are Latin-1 bytes
+ *   entities   dense entity and numeric character references, a few bad
+ *   emoji      titles mostly emoji (4 byte UTF-8)
+ *
+ * The output is always the same for the same arguments so that results
+ * can be compared across versions. The last record is cut off at size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUF_SIZE 65536
+
+static unsigned long long seed=88172645463325252ULL;
+
+/* xorshift64, fixed seed so corpora are reproducible */
+static unsigned int rnd(unsigned int n) {
+  seed^=seed<<13;
+  seed^=seed>>7;
+  seed^=seed<<17;
+  return((unsigned int)((seed>>16)%n));
+}
+
+static unsigned char buf[BUF_SIZE+4096]; /* room for a record beyond BUF_SIZE */
+static size_t nbuf=0;
+static unsigned long long left;
+
+static void put(const char* s, size_t n) {
+  memcpy(buf+nbuf,s,n);
+  nbuf+=n;
+}
+
+static void putStr(const char* s) {
+  put(s,strlen(s));
+}
+
+static void putCode(unsigned int u) {
+  if (u<0x80) {
+    buf[nbuf++]=(unsigned char)u;
+  } else if (u<0x800) {
+    buf[nbuf++]=(unsigned char)(0xC0|(u>>6));
+    buf[nbuf++]=(unsigned char)(0x80|(u&0x3F));
+  } else if (u<0x10000) {
+    buf[nbuf++]=(unsigned char)(0xE0|(u>>12));
+    buf[nbuf++]=(unsigned char)(0x80|((u>>6)&0x3F));
+    buf[nbuf++]=(unsigned char)(0x80|(u&0x3F));
+  } else {
+    buf[nbuf++]=(unsigned char)(0xF0|(u>>18));
+    buf[nbuf++]=(unsigned char)(0x80|((u>>12)&0x3F));
+    buf[nbuf++]=(unsigned char)(0x80|((u>>6)&0x3F));
+    buf[nbuf++]=(unsigned char)(0x80|(u&0x3F));
+  }
+}
+
+/* a word of lower case letters, latin1 in 10000 of them raw Latin-1 */
+static void putWord(unsigned int latin1) {
+  int j, n=2+rnd(8);
+  for (j=0; j<n; j++) {
+    if (latin1>0 && rnd(10000)<latin1) {
+      buf[nbuf++]=(unsigned char)(0xE0+rnd(32));
+    } else {
+      buf[nbuf++]=(unsigned char)('a'+rnd(26));
+    }
+  }
+}
+
+static void putEntity(void) {
+  static const char* named[] = { "&amp;", "&lt;", "&gt;", "&quot;", "&apos;" };
+  char s[32];
+  switch (rnd(8)) {
+    case 0: case 1:
+      putStr(named[rnd(5)]);
+      break;
+    case 2: case 3:
+      sprintf(s,"&#%u;",0x20+rnd(0xD000));
+      putStr(s);
+      break;
+    case 4: case 5:
+      sprintf(s,"&#x%X;",0x20+rnd(0x10000));
+      putStr(s);
+      break;
+    case 6:
+      sprintf(s,"&#x%X;",0x10000+rnd(0x100000));
+      putStr(s);
+      break;
+    default:
+      putStr(rnd(4)==0 ? "&#1;" : (rnd(2) ? "&nbsp;" : "&bad entity;"));
+  }
+}
+
+/* title text for each type of corpus */
+static void putTitle(const char* type) {
+  int j, n=5+rnd(20);
+  for (j=0; j<n; j++) {
+    if (strcmp(type,"cjk")==0) {
+      putCode(0x4E00+rnd(0x5200));
+      if (rnd(10)==0) putCode(0x3002);
+    } else if (strcmp(type,"emoji")==0) {
+      if (rnd(4)==0) {
+        putWord(0);
+        putCode(' ');
+      } else {
+        putCode(0x1F300+rnd(0x350));
+      }
+    } else if (strcmp(type,"entities")==0) {
+      putWord(0);
+      putEntity();
+    } else if (strcmp(type,"latin1-1")==0) {
+      putWord(100);
+      putCode(' ');
+    } else if (strcmp(type,"latin1-20")==0) {
+      putWord(2000);
+      putCode(' ');
+    } else {
+      putWord(0);
+      putCode(' ');
+    }
+  }
+}
+
+static void flush(size_t n) {
+  if (n>left) {
+    n=(size_t)left;
+  }
+  if (fwrite(buf,1,n,stdout)!=n) {
+    perror("mkcorpus");
+    exit(1);
+  }
+  left-=n;
+  memmove(buf,buf+n,nbuf-n);
+  nbuf-=n;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned long id=0;
+  char* end;
+  char s[100];
+
+  if (argc!=3) {
+    fprintf(stderr,"usage: %s ascii|cjk|latin1-1|latin1-20|entities|emoji size[K|M|G]\n",argv[0]);
+    exit(1);
+  }
+  if (strcmp(argv[1],"ascii")!=0 && strcmp(argv[1],"cjk")!=0 &&
+      strcmp(argv[1],"latin1-1")!=0 && strcmp(argv[1],"latin1-20")!=0 &&
+      strcmp(argv[1],"entities")!=0 && strcmp(argv[1],"emoji")!=0) {
+    fprintf(stderr,"Unknown corpus type '%s', aborting!\n",argv[1]);
+    exit(1);
+  }
+  left=strtoull(argv[2],&end,0);
+  switch (*end) {
+    case 'K': case 'k': left<<=10; break;
+    case 'M': case 'm': left<<=20; break;
+    case 'G': case 'g': left<<=30; break;
+  }
+
+  putStr("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<OAI-PMH>\n<ListRecords>\n");
+  while (left>0) {
+    sprintf(s,"<record><header><identifier>oai:bench:%lu</identifier></header>\n",id++);
+    putStr(s);
+    putStr("<metadata><dc><title>");
+    putTitle(argv[1]);
+    putStr("</title>\n<creator>");
+    putTitle(argv[1]);
+    putStr("</creator></dc></metadata></record>\n");
+    if (nbuf>=BUF_SIZE) {
+      flush(BUF_SIZE);
+    }
+  }
+  return(0);
+}
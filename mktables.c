@@ -0,0 +1,248 @@
+/* Generate decoder tables for utf8conditioner
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * Writes utf8tables.h to stdout. This is run as part of the build so
+ * that the tables are derived from the rules below rather than typed in.
+ *
+ * Each input byte is mapped to one of NCLASS byte classes. The decoder
+ * starts each character in state 0 and takes one step per byte,
+ *   state = trans[state+class]
+ * state values are pre-multiplied by NCLASS. Once all continuation bytes
+ * have been read the state is one of the verdicts UTF8_OK, UTF8_OVERLONG,
+ * UTF8_BAD (surrogate or code above 0x10FFFF) or UTF8_CHECK (value must
+ * be checked with validUTF8Char()). A byte that is not a continuation
+ * leads to UTF8_REJECT and a byte that cannot start a character gives
+ * UTF8_ILLEGAL from state 0.
+ *
+ * Two tables are written: strict, and lax (-l) where overlong forms are
+ * not errors. Overlong 2 and 3 byte forms are always valid codes, longer
+ * ones may encode surrogates or codes above 0x10FFFF and so need
+ * UTF8_CHECK.
+ *
+ * Also written is the class of each code point up to 0x10FFFF, a
+ * combination of UTF8_CODE_XML1_0 (not allowed in XML1.0),
+ * UTF8_CODE_XML1_1 (not allowed in XML1.1) and UTF8_CODE_RESTRICTED
+ * (XML1.1 RestrictedChar). This is a flat table for the BMP and for the
+ * other planes an index of 256 code blocks, identical blocks are shared.
+ *
+ * utf8NameByte[] is true for bytes that may be part of an XML Name: the
+ * ASCII NameChars and any byte of a multi-byte character (which must be
+ * decoded to check it).
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+/* byte classes */
+enum { C_ASCII, C_80_83, C_84_87, C_88_8F, C_90_9F, C_A0_BF,
+       C_C0_C1, C_C2_DF, C_E0, C_E1_EF, C_ED, C_F0, C_F1_F3, C_F4, C_F5_F7,
+       C_F8, C_F9_FB, C_FC, C_FD, C_FE_FF, NCLASS };
+
+/* verdicts, the first states */
+enum { OK, OVERLONG, BAD, CHECK, REJECT, ILLEGAL, NVERDICT };
+
+/* states waiting for r more continuation bytes with verdict v */
+#define R(r,v) (NVERDICT+((r)-1)*4+(v))
+
+/* states where the next byte decides the verdict */
+enum { D_E0=R(5,CHECK)+1, D_ED, D_F0, D_F4, D_F8, D_FC, NSTATE };
+
+int classOf(int b) {
+  if (b<0x80) return(C_ASCII);
+  if (b<0x84) return(C_80_83);
+  if (b<0x88) return(C_84_87);
+  if (b<0x90) return(C_88_8F);
+  if (b<0xA0) return(C_90_9F);
+  if (b<0xC0) return(C_A0_BF);
+  if (b<0xC2) return(C_C0_C1);
+  if (b<0xE0) return(C_C2_DF);
+  if (b==0xE0) return(C_E0);
+  if (b==0xED) return(C_ED);
+  if (b<0xF0) return(C_E1_EF);
+  if (b==0xF0) return(C_F0);
+  if (b<0xF4) return(C_F1_F3);
+  if (b==0xF4) return(C_F4);
+  if (b<0xF8) return(C_F5_F7);
+  if (b==0xF8) return(C_F8);
+  if (b<0xFC) return(C_F9_FB);
+  if (b==0xFC) return(C_FC);
+  if (b==0xFD) return(C_FD);
+  return(C_FE_FF);
+}
+
+/* lowest continuation byte class whose value is no longer overlong
+ * (D_E0, D_F0, D_F8, D_FC) or is too large or a surrogate (D_ED, D_F4)
+ */
+int splitClass(int state) {
+  switch (state) {
+    case D_E0: return(C_A0_BF);
+    case D_ED: return(C_A0_BF);
+    case D_F0: return(C_90_9F);
+    case D_F4: return(C_90_9F);
+    case D_F8: return(C_88_8F);
+    default:   return(C_84_87); /* D_FC */
+  }
+}
+
+int next(int state, int c, int lax) {
+  int r, v, below, above;
+  int isCont=(c>=C_80_83 && c<=C_A0_BF);
+
+  if (state==OK) {
+    switch (c) {
+      case C_ASCII:  return(OK);
+      case C_C0_C1:  return(R(1,lax?OK:OVERLONG));
+      case C_C2_DF:  return(R(1,OK));
+      case C_E0:     return(D_E0);
+      case C_E1_EF:  return(R(2,OK));
+      case C_ED:     return(D_ED);
+      case C_F0:     return(D_F0);
+      case C_F1_F3:  return(R(3,OK));
+      case C_F4:     return(D_F4);
+      case C_F5_F7:  return(R(3,BAD));
+      case C_F8:     return(D_F8);
+      case C_F9_FB:  return(R(4,BAD));
+      case C_FC:     return(D_FC);
+      case C_FD:     return(R(5,BAD));
+      default:       return(ILLEGAL); /* continuation, 0xFE or 0xFF */
+    }
+  }
+  if (state<NVERDICT || !isCont) {
+    return(REJECT);
+  }
+  if (state>=D_E0) {
+    switch (state) {
+      case D_E0: r=2; below=(lax?OK:OVERLONG);    above=OK;  break;
+      case D_ED: r=2; below=OK;                   above=BAD; break;
+      case D_F0: r=3; below=(lax?CHECK:OVERLONG); above=OK;  break;
+      case D_F4: r=3; below=OK;                   above=BAD; break;
+      case D_F8: r=4; below=(lax?CHECK:OVERLONG); above=BAD; break;
+      default:   r=5; below=(lax?CHECK:OVERLONG); above=BAD; break;
+    }
+    v=(c<splitClass(state) ? below : above);
+  } else {
+    r=(state-NVERDICT)/4+1;
+    v=(state-NVERDICT)%4;
+  }
+  return(r==1 ? v : R(r-1,v));
+}
+
+/* XML character classes, see validXML1_0Char() etc. in utf8cond.c */
+int codeClass(unsigned int ch) {
+  int cls=0;
+  if (!(ch==0x09 || ch==0x0A || ch==0x0D || (ch>=0x20 && ch<=0xD7FF) ||
+        (ch>=0xE000 && ch<=0xFFFD) || (ch>=0x10000 && ch<=0x10FFFF))) {
+    cls|=1;
+  }
+  if (!((ch>=0x1 && ch<=0xD7FF) || (ch>=0xE000 && ch<=0xFFFD) ||
+        (ch>=0x10000 && ch<=0x10FFFF))) {
+    cls|=2;
+  }
+  if ((ch>=0x1 && ch<=0x8) || (ch>=0xB && ch<=0xC) || (ch>=0xE && ch<=0x1F) ||
+      (ch>=0x7F && ch<=0x84) || (ch>=0x86 && ch<=0xBF)) {
+    cls|=4;
+  }
+  return(cls);
+}
+
+#define NPLANEBLOCK ((0x110000-0x10000)>>8)
+
+void writeCodeClasses(void) {
+  static unsigned char block[NPLANEBLOCK][256];
+  static int index[NPLANEBLOCK];
+  int nblocks=0;
+  unsigned int ch;
+  int b, k;
+
+  printf("#define UTF8_CODE_XML1_0 1\n");
+  printf("#define UTF8_CODE_XML1_1 2\n");
+  printf("#define UTF8_CODE_RESTRICTED 4\n\n");
+  printf("static const unsigned char utf8CodeClassBMP[65536] = {\n");
+  for (ch=0; ch<0x10000; ch++) {
+    printf("%s%d,%s", (ch%32==0 ? "  " : ""), codeClass(ch), (ch%32==31 ? "\n" : ""));
+  }
+  printf("};\n\n");
+
+  for (b=0; b<NPLANEBLOCK; b++) {
+    for (ch=0; ch<256; ch++) {
+      block[nblocks][ch]=(unsigned char)codeClass(0x10000+(b<<8)+ch);
+    }
+    for (k=0; k<nblocks && memcmp(block[k],block[nblocks],256)!=0; k++);
+    index[b]=k;
+    if (k==nblocks) { nblocks++; }
+  }
+  printf("/* blocks of 256 codes for 0x10000 to 0x10FFFF */\n");
+  printf("static const unsigned char utf8CodeClassPlaneIndex[%d] = {\n", NPLANEBLOCK);
+  for (b=0; b<NPLANEBLOCK; b++) {
+    printf("%s%d,%s", (b%32==0 ? "  " : ""), index[b], (b%32==31 ? "\n" : ""));
+  }
+  printf("};\n");
+  printf("static const unsigned char utf8CodeClassPlaneBlock[%d][256] = {\n", nblocks);
+  for (k=0; k<nblocks; k++) {
+    printf("  {");
+    for (ch=0; ch<256; ch++) { printf("%d,", block[k][ch]); }
+    printf("},\n");
+  }
+  printf("};\n\n");
+}
+
+void writeTrans(const char* name, int lax) {
+  int s, c;
+  printf("static const unsigned short %s[%d] = {\n", name, NSTATE*NCLASS);
+  for (s=0; s<NSTATE; s++) {
+    printf("  ");
+    for (c=0; c<NCLASS; c++) {
+      printf("%d,", next(s,c,lax)*NCLASS);
+    }
+    printf("\n");
+  }
+  printf("};\n\n");
+}
+
+int main(void) {
+  int b, c;
+  static const int contBytes[NCLASS] =
+    { 0, 0,0,0,0,0, 1,1, 2,2,2, 3,3,3,3, 4,4, 5,5, 0 };
+  static const int leadMask[NCLASS] =
+    { 0x7F, 0xFF,0xFF,0xFF,0xFF,0xFF, 0x1F,0x1F, 0x0F,0x0F,0x0F, 0x07,0x07,0x07,0x07,
+      0x03,0x03, 0x01,0x01, 0xFF };
+
+  printf("/* utf8tables.h - generated by mktables, do not edit */\n\n");
+  printf("#define UTF8_NCLASS %d\n", NCLASS);
+  printf("#define UTF8_OK %d\n", OK*NCLASS);
+  printf("#define UTF8_OVERLONG %d\n", OVERLONG*NCLASS);
+  printf("#define UTF8_BAD %d\n", BAD*NCLASS);
+  printf("#define UTF8_CHECK %d\n", CHECK*NCLASS);
+  printf("#define UTF8_REJECT %d\n", REJECT*NCLASS);
+  printf("#define UTF8_ILLEGAL %d\n\n", ILLEGAL*NCLASS);
+
+  printf("static const unsigned char utf8ByteClass[256] = {\n");
+  for (b=0; b<256; b++) {
+    printf("%s%d,%s", (b%16==0 ? "  " : ""), classOf(b), (b%16==15 ? "\n" : ""));
+  }
+  printf("};\n\n");
+
+  printf("/* number of continuation bytes and mask for lead byte, by class */\n");
+  printf("static const unsigned char utf8ContBytes[%d] = { ", NCLASS);
+  for (c=0; c<NCLASS; c++) { printf("%d,", contBytes[c]); }
+  printf(" };\n");
+  printf("static const unsigned char utf8LeadMask[%d] = { ", NCLASS);
+  for (c=0; c<NCLASS; c++) { printf("0x%02X,", leadMask[c]); }
+  printf(" };\n\n");
+
+  printf("static const unsigned char utf8NameByte[256] = {\n");
+  for (b=0; b<256; b++) {
+    printf("%s%d,%s", (b%16==0 ? "  " : ""),
+           (b>=0x80 || (b>='a' && b<='z') || (b>='A' && b<='Z') || (b>='0' && b<='9') ||
+            b=='.' || b=='-' || b=='_' || b==':'), (b%16==15 ? "\n" : ""));
+  }
+  printf("};\n\n");
+
+  writeTrans("utf8StrictTrans",0);
+  writeTrans("utf8LaxTrans",1);
+  writeCodeClasses();
+  return(0);
+}
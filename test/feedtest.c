@@ -0,0 +1,41 @@
+/* feedtest - check libutf8conditioner with input fed one byte at a time
+ *
+ * Reads stdin and conditions it as utf8conditioner -x, but passes each
+ * byte to utf8condFeed() separately so that every character and entity
+ * reference is split across chunks. Output and errors should be the
+ * same as from utf8conditioner.
+ */
+
+#include <stdio.h>
+#include "../utf8cond.h"
+
+void writeOutput(void* ctx, const unsigned char* s, size_t n) {
+  (void)ctx;
+  fwrite(s,1,n,stdout);
+}
+
+void printError(void* ctx, const utf8condError* e) {
+  char msg[1024];
+
+  (void)ctx;
+  utf8condErrorText(e,msg,sizeof(msg));
+  fprintf(stderr,"Line %llu, char %llu, byte %llu: %s\n",e->line,e->chr,e->byte,msg);
+}
+
+int main(void) {
+  utf8condOptions opt;
+  utf8cond* c;
+  int ch;
+  unsigned char b;
+
+  utf8condDefaults(&opt);
+  opt.checkXML1_0Chars=1;
+  c=utf8condNew(&opt,writeOutput,printError,NULL);
+  while ((ch=getchar())!=EOF) {
+    b=(unsigned char)ch;
+    utf8condFeed(c,&b,1);
+  }
+  utf8condFinish(c);
+  utf8condFree(c);
+  return(0);
+}
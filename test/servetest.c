@@ -0,0 +1,102 @@
+/* servetest - client for utf8conditioner --serve
+ *
+ * usage: servetest socket [-n count] [option ...] < input
+ *
+ * Sends stdin as a request with the options given, count times (default
+ * once) on one connection, and writes the output of the last reply to
+ * stdout and its messages to stderr. With -n the time per request is
+ * reported on stderr, for load testing on localhost. Exits 1 if the
+ * server rejects the request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+static int sendAll(int fd, const char* s, size_t n) {
+  ssize_t w;
+
+  while (n>0) {
+    if ((w=write(fd,s,n))<=0) {
+      return(0);
+    }
+    s+=w;
+    n-=(size_t)w;
+  }
+  return(1);
+}
+
+static int readAll(FILE* fp, char* s, size_t n) {
+  return(fread(s,1,n,fp)==n);
+}
+
+int main(int argc, char* argv[]) {
+  struct sockaddr_un addr;
+  struct timeval t0, t1;
+  char head[1024];
+  char* in=NULL;
+  char* out;
+  char* msgs;
+  size_t nin=0, max=0, n;
+  unsigned long int nout, nmsgs, changed;
+  int fd, j=2, count=1, k, numErrors=0;
+  FILE* fp;
+
+  if (argc<2) {
+    fprintf(stderr,"usage: %s socket [-n count] [option ...] < input\n",argv[0]);
+    return(2);
+  }
+  if (argc>3 && strcmp(argv[2],"-n")==0) {
+    count=atoi(argv[3]);
+    j=4;
+  }
+  do {
+    if (nin==max && (in=(char*)realloc(in,max=2*max+65536))==NULL) {
+      return(2);
+    }
+    nin+=(n=fread(in+nin,1,max-nin,stdin));
+  } while (n>0);
+  snprintf(head,sizeof(head),"%lu",(unsigned long int)nin);
+  for (; j<argc; j++) {
+    strncat(head," ",sizeof(head)-strlen(head)-1);
+    strncat(head,argv[j],sizeof(head)-strlen(head)-1);
+  }
+  strncat(head,"\n",sizeof(head)-strlen(head)-1);
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strncpy(addr.sun_path,argv[1],sizeof(addr.sun_path)-1);
+  if ((fd=socket(AF_UNIX,SOCK_STREAM,0))<0 ||
+      connect(fd,(struct sockaddr*)&addr,sizeof(addr))!=0 ||
+      (fp=fdopen(fd,"r"))==NULL) {
+    perror(argv[1]);
+    return(2);
+  }
+  gettimeofday(&t0,NULL);
+  for (k=0; k<count; k++) {
+    if (!sendAll(fd,head,strlen(head)) || !sendAll(fd,in,nin) ||
+        fscanf(fp,"%d %lu %lu %lu",&numErrors,&changed,&nout,&nmsgs)!=4 || getc(fp)!='\n' ||
+        (out=(char*)malloc(nout+1))==NULL || (msgs=(char*)malloc(nmsgs+1))==NULL ||
+        !readAll(fp,out,nout) || !readAll(fp,msgs,nmsgs)) {
+      fprintf(stderr,"Bad reply\n");
+      return(2);
+    }
+    if (k==count-1) {
+      fwrite(out,1,nout,stdout);
+      fwrite(msgs,1,nmsgs,stderr);
+    }
+    free(out);
+    free(msgs);
+  }
+  gettimeofday(&t1,NULL);
+  if (count>1) {
+    fprintf(stderr,"%d requests, %.1f us each\n",count,
+            ((t1.tv_sec-t0.tv_sec)*1e6+(t1.tv_usec-t0.tv_usec))/count);
+  }
+  fclose(fp);
+  return(numErrors<0 ? 1 : 0);
+}
@@ -0,0 +1,1974 @@
+/* libutf8conditioner - UTF-8 checker and conditioner library
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes 
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * I assume that the most likely cause of errors is inclusion of non-UTF-8
+ * bytes from various 8-bit character sets. Thus, any attempt to read a
+ * sequence of continuation bytes that finds an invalid byte will result
+ * in the termination of the attempt to read the multi-byte character. Each
+ * valid single byte will be written out, invalid single bytes will be 
+ * replaced with a dummy character. The hope is that this will avoid an 
+ * error having run-on effects which might interfere with XML markup.
+ * (Option -m changes this behaviour to replace an invalid multi-byte
+ * with a single dummy character.)
+ *
+ * See utf8cond.h for the interface. All state is held in the utf8cond
+ * object so input may be fed in chunks split at any point. Positions
+ * are 64-bit counts; lines and characters are counted over blocks of
+ * input after they are conditioned (see countPositions()), not as
+ * each byte is read.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h> /* for clock_gettime() */
+#include "utf8cond.h"
+#include "utf8tables.h" /* decoder tables, generated by mktables */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h> /* for __rdtsc() */
+#define HAVE_TSC
+#include <immintrin.h>
+#define HAVE_SIMD_VALIDATOR
+#endif
+
+#define MAX_BYTES 10               /* longest UTF-8 char, or NCR to copy &#x10FFFF\0 */
+#define BYTE_SIZE 64               /* starting size of byte[], >UTF8COND_MAX_BYTES */
+#define COUNT_BLOCK 16384          /* input conditioned before lines and chars are counted */
+#define REPAIR_BLOCK 1024          /* input transcoded by repairRun() for each write */
+
+/* Checks on each code point, in order of precedence. Code classes are
+ * looked up in the tables from mktables, plus CODE_BAD for -b codes,
+ * and codeChecks[] gives the check that fails for each class with the
+ * options set.
+ */
+#define CHECK_OK 0
+#define CHECK_XML1_0 1
+#define CHECK_XML1_1 2
+#define CHECK_BAD 3
+#define CHECK_RESTRICTED 4
+#define CODE_BAD 8
+
+struct utf8cond {
+  utf8condOptions opt;            /* options as passed to utf8condNew() */
+  int checkEntities;              /* check entities if any XML checks are on */
+  utf8condWriteFn write;          /* output callback */
+  utf8condErrorFn report;         /* error callback */
+  void* ctx;                      /* passed to callbacks */
+
+  utf8condError err;              /* error record being built for the current char */
+  int* byte;                      /* bytes of UTF-8 char or entity reference (at least
+                                     BYTE_SIZE, grown for long entity references) */
+  size_t maxByte;
+  unsigned long long bytenum;     /* count of bytes read, to the start of the buffer being conditioned */
+  unsigned long long charnum;     /* count of characters, see countPositions() */
+  unsigned long long linenum;     /* count of lines */
+  int numErrors;                  /* count of errors */
+  unsigned long int numChanged;   /* count of chars written differently */
+
+  /* bytes held over from the end of one chunk to the next, never more
+   * than MAX_BYTES-1 between calls unless in an entity reference */
+  unsigned char* pend;
+  size_t npend, maxPend;
+
+  /* entity names that may be referred to, opt.entities or ownEntities */
+  const utf8condNameSet* entities;
+  utf8condNameSet* ownEntities;
+
+  /*
+   * Fast path for runs of ASCII that need no change. asciiClean[b] is true
+   * if the single byte b can never produce an error with the current
+   * options. If the only unclean bytes are controls, DEL and '&' then
+   * runs can be found with SIMD compares (asciiSimd), otherwise (some
+   * -b codes) each byte is looked up.
+   */
+  unsigned char asciiClean[128];
+  int asciiSimd;
+
+  /*
+   * Vectorized validation of whole chunks for -c (see validRun()), used
+   * if the CPU supports it and there are no -b codes above 0x7F.
+   * asciiNibbles[] is asciiClean[] as a bitmap for SIMD lookup.
+   */
+  int useValidator;
+  unsigned char asciiNibbles[16];
+
+  /* check to make for each code class (see codeCheck()) */
+  unsigned char codeChecks[16];
+
+  /* decoder state transitions, utf8StrictTrans or utf8LaxTrans for -l */
+  const unsigned short* decodeTrans;
+
+  /*
+   * With opt.repair, the UTF-8 for each byte 0x80-0xFF taken as a
+   * character of the charset, or the substitute character if that code
+   * fails the checks (see setupRepair()).
+   */
+  unsigned char repairBytes[128][3];
+  unsigned char repairLen[128];
+
+  /*
+   * Stats, only if collectStats is set. Time in each path is counted
+   * in ticks of the cheapest clock (see ticks()), converted to seconds
+   * by comparing with the elapsed time since stats were turned on.
+   */
+  int collectStats;
+  utf8condStats stats;
+  unsigned long long startLine, startChar; /* position when turned on */
+  unsigned long long fastTicks, slowTicks;
+  unsigned long long startTicks;
+  double startTime;
+};
+
+int validXML1_0Char(unsigned int ch);
+int validXML1_1Char(unsigned int ch);
+int restrictedXML1_1Char(unsigned int ch);
+int validUTF8Char(unsigned int ch);
+unsigned int parseNumericCharacterReference(int b[]);
+static int validEntity(const utf8cond* c, const unsigned char* name, size_t len);
+static int nameChar(unsigned int u, int first);
+static size_t nameRun(const unsigned char* s, size_t n);
+static size_t utf8Run(const unsigned char* s, size_t n, int* partial);
+static int inEntity(const unsigned char* buf, size_t pos);
+static int growBytes(utf8cond* c, size_t need);
+static int growPend(utf8cond* c, size_t need);
+static utf8condNameSet* predefinedEntities(void);
+static void addPart(utf8cond* c, int kind, unsigned long long arg, int arg2);
+static size_t conditionBuffer(utf8cond* c, const unsigned char* in, size_t len, int eof);
+static void writeSpan(utf8cond* c, const unsigned char* s, size_t n);
+static void writePieces(utf8cond* c, const unsigned char* s, size_t n);
+static void writeBytes(utf8cond* c, const int* b, int n);
+static void setupCodeChecks(utf8cond* c);
+static int codeCheck(const utf8cond* c, unsigned int code);
+static void setupAsciiRun(utf8cond* c);
+static size_t asciiRun(utf8cond* c, const unsigned char* s, size_t n);
+static void setupRepair(utf8cond* c);
+static size_t repairRun(utf8cond* c, const unsigned char* s, size_t n, const int checkOnly);
+static void countPositions(utf8cond* c, const unsigned char* s, size_t n);
+static unsigned long long ticks(void);
+static double seconds(void);
+static void setupValidator(utf8cond* c);
+#ifdef HAVE_SIMD_VALIDATOR
+static size_t validRun(utf8cond* c, const unsigned char* s, size_t n);
+#endif
+
+
+/* Set opt to the defaults, equivalent to no command line options */
+void utf8condDefaults(utf8condOptions* opt) {
+  memset(opt,0,sizeof(*opt));
+  opt->maxErrors=1000;
+  opt->substituteChar='?';
+  opt->checkOverlong=1;
+}
+
+
+/* Add code to the bad codes. Returns 0 if out of memory. */
+int utf8condAddBadChar(utf8condOptions* opt, unsigned int code) {
+  return(utf8condAddBadRange(opt,code,code));
+}
+
+
+/* Add the codes first to last to the bad codes. Returns 0 if out of
+ * memory. The set is shared by copies of opt and by conditioners made
+ * with it, free with utf8condFreeOptions() once they are done.
+ */
+int utf8condAddBadRange(utf8condOptions* opt, unsigned int first, unsigned int last) {
+  if (opt->badCodes==NULL && (opt->badCodes=utf8condCodeSetNew())==NULL) {
+    return(0);
+  }
+  return(utf8condCodeSetAdd(opt->badCodes,first,last));
+}
+
+
+/* Add name to the entities that may be referred to, as well as the
+ * five XML predefines. Returns 0 if name isn't an XML Name or out of
+ * memory. Shared as the bad codes are.
+ */
+int utf8condAddEntity(utf8condOptions* opt, const char* name, size_t len) {
+  if (!utf8condValidName((const unsigned char*)name,len)) {
+    return(0);
+  }
+  if (opt->entities==NULL && (opt->entities=predefinedEntities())==NULL) {
+    return(0);
+  }
+  return(utf8condNameSetAdd(opt->entities,(const unsigned char*)name,len));
+}
+
+
+void utf8condFreeOptions(utf8condOptions* opt) {
+  utf8condCodeSetFree(opt->badCodes);
+  opt->badCodes=NULL;
+  utf8condNameSetFree(opt->entities);
+  opt->entities=NULL;
+}
+
+
+/* A code set has a 256 bit block for each 256 codes up to 0x10FFFF, or
+ * NULL if there are none in it. Codes above 0x10FFFF can't get as far
+ * as the checks so aren't stored, and code 0 is never a bad code (it
+ * used to end the list).
+ */
+#define CODESET_BLOCKS (0x110000>>8)
+
+struct utf8condCodeSet {
+  unsigned char* block[CODESET_BLOCKS];
+  int nonAscii;                   /* true if any code above 0x7F */
+};
+
+utf8condCodeSet* utf8condCodeSetNew(void) {
+  return((utf8condCodeSet*)calloc(1,sizeof(utf8condCodeSet)));
+}
+
+/* Add codes first to last, returns 0 if out of memory */
+int utf8condCodeSetAdd(utf8condCodeSet* set, unsigned int first, unsigned int last) {
+  unsigned int code;
+  unsigned char* b;
+
+  if (first==0) { first=1; }
+  if (last>0x10FFFF) { last=0x10FFFF; }
+  if (last>0x7F && first<=last) { set->nonAscii=1; }
+  for (code=first; code<=last; code++) {
+    if ((b=set->block[code>>8])==NULL &&
+        (b=set->block[code>>8]=(unsigned char*)calloc(32,1))==NULL) {
+      return(0);
+    }
+    if ((code&0xFF)==0 && last-code>=0xFF) {
+      memset(b,0xFF,32); /* whole block */
+      code+=0xFF;
+    } else {
+      b[(code&0xFF)>>3]|=(unsigned char)(1<<(code&7));
+    }
+  }
+  return(1);
+}
+
+int utf8condCodeSetHas(const utf8condCodeSet* set, unsigned int code) {
+  const unsigned char* b;
+  return(code<=0x10FFFF && (b=set->block[code>>8])!=NULL &&
+         (b[(code&0xFF)>>3]&(1<<(code&7)))!=0);
+}
+
+void utf8condCodeSetFree(utf8condCodeSet* set) {
+  int k;
+  if (set==NULL) {
+    return;
+  }
+  for (k=0; k<CODESET_BLOCKS; k++) {
+    free(set->block[k]);
+  }
+  free(set);
+}
+
+
+/* A name set is an open addressed hash table of names with their hash
+ * values, kept at most half full. Lookups compare the hash first so
+ * usually only one name is compared.
+ */
+typedef struct nameEntry {
+  unsigned int hash;
+  size_t len;
+  unsigned char* name;            /* NULL for an empty slot */
+} nameEntry;
+
+struct utf8condNameSet {
+  nameEntry* slot;
+  size_t size;                    /* number of slots, a power of 2 */
+  size_t count;
+};
+
+/* FNV-1a */
+static unsigned int nameHash(const unsigned char* name, size_t len) {
+  unsigned int h=2166136261u;
+  size_t j;
+  for (j=0; j<len; j++) {
+    h=(h^name[j])*16777619u;
+  }
+  return(h);
+}
+
+utf8condNameSet* utf8condNameSetNew(void) {
+  utf8condNameSet* set=(utf8condNameSet*)calloc(1,sizeof(utf8condNameSet));
+  if (set!=NULL && (set->slot=(nameEntry*)calloc(16,sizeof(nameEntry)))==NULL) {
+    free(set);
+    return(NULL);
+  }
+  if (set!=NULL) {
+    set->size=16;
+  }
+  return(set);
+}
+
+/* Add name, returns 0 if out of memory */
+int utf8condNameSetAdd(utf8condNameSet* set, const unsigned char* name, size_t len) {
+  unsigned int h=nameHash(name,len);
+  nameEntry* old;
+  size_t j, k, n;
+
+  if (utf8condNameSetHas(set,name,len)) {
+    return(1);
+  }
+  if (2*(set->count+1)>set->size) {
+    /* rehash into twice the slots */
+    old=set->slot;
+    n=set->size;
+    if ((set->slot=(nameEntry*)calloc(2*n,sizeof(nameEntry)))==NULL) {
+      set->slot=old;
+      return(0);
+    }
+    set->size=2*n;
+    for (j=0; j<n; j++) {
+      if (old[j].name!=NULL) {
+        for (k=old[j].hash&(set->size-1); set->slot[k].name!=NULL; k=(k+1)&(set->size-1));
+        set->slot[k]=old[j];
+      }
+    }
+    free(old);
+  }
+  for (k=h&(set->size-1); set->slot[k].name!=NULL; k=(k+1)&(set->size-1));
+  if ((set->slot[k].name=(unsigned char*)malloc(len+1))==NULL) {
+    return(0);
+  }
+  memcpy(set->slot[k].name,name,len);
+  set->slot[k].name[len]='\0';
+  set->slot[k].len=len;
+  set->slot[k].hash=h;
+  set->count++;
+  return(1);
+}
+
+int utf8condNameSetHas(const utf8condNameSet* set, const unsigned char* name, size_t len) {
+  unsigned int h=nameHash(name,len);
+  size_t k;
+  for (k=h&(set->size-1); set->slot[k].name!=NULL; k=(k+1)&(set->size-1)) {
+    if (set->slot[k].hash==h && set->slot[k].len==len && memcmp(set->slot[k].name,name,len)==0) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+void utf8condNameSetFree(utf8condNameSet* set) {
+  size_t k;
+  if (set==NULL) {
+    return;
+  }
+  for (k=0; k<set->size; k++) {
+    free(set->slot[k].name);
+  }
+  free(set->slot);
+  free(set);
+}
+
+/* New name set with the five XML predefined entities */
+static utf8condNameSet* predefinedEntities(void) {
+  static const char* names[] = { "amp", "lt", "gt", "quot", "apos" };
+  utf8condNameSet* set=utf8condNameSetNew();
+  int j;
+  for (j=0; set!=NULL && j<5; j++) {
+    if (!utf8condNameSetAdd(set,(const unsigned char*)names[j],strlen(names[j]))) {
+      utf8condNameSetFree(set);
+      set=NULL;
+    }
+  }
+  return(set);
+}
+
+
+/* Hash of the options that decide which characters are errors or are
+ * replaced, the same for options that give the same verdict on any
+ * input (but not only then). Used to know whether an earlier result
+ * still applies. */
+unsigned long long utf8condOptionsHash(const utf8condOptions* opt) {
+  unsigned long long h=14695981039346656037ULL, names=0;
+  size_t k, j;
+
+#define HASH_ADD(v) (h=(h^(unsigned long long)(v))*1099511628211ULL)
+  HASH_ADD(opt->checkXML1_0Chars);
+  HASH_ADD(opt->checkXML1_1Chars);
+  HASH_ADD(opt->checkXML1_1Restricted);
+  HASH_ADD(opt->checkOverlong);
+  if (opt->badCodes!=NULL) {
+    for (k=0; k<CODESET_BLOCKS; k++) {
+      if (opt->badCodes->block[k]!=NULL) {
+        HASH_ADD(k);
+        for (j=0; j<32; j++) {
+          HASH_ADD(opt->badCodes->block[k][j]);
+        }
+      }
+    }
+  }
+  if (opt->entities!=NULL) {
+    /* the order of names depends on how they were added, so sum */
+    for (k=0; k<opt->entities->size; k++) {
+      if (opt->entities->slot[k].name!=NULL) {
+        names+=(opt->entities->slot[k].hash|((unsigned long long)opt->entities->slot[k].len<<32))*
+               0x9E3779B97F4A7C15ULL;
+      }
+    }
+    HASH_ADD(names);
+  }
+#undef HASH_ADD
+  return(h);
+}
+
+
+/* Set XML checks from the type given to -X: "1.0", "1.1" or "1.1lax".
+ * Returns 0 if type is not recognized.
+ */
+int utf8condSetXML(utf8condOptions* opt, const char* type) {
+  if (strcmp(type,"1.0")==0) {
+    opt->checkXML1_0Chars=1;
+  } else if (strcmp(type,"1.1")==0) {
+    opt->checkXML1_1Chars=1;
+    opt->checkXML1_1Restricted=1;
+  } else if (strcmp(type,"1.1lax")==0) {
+    opt->checkXML1_1Chars=1;
+  } else {
+    return(0);
+  }
+  return(1);
+}
+
+
+/* Set the charset to repair bad UTF-8 from: "latin1" (ISO-8859-1) or
+ * "cp1252" (Windows-1252). Returns 0 if charset is not recognized.
+ */
+int utf8condSetRepair(utf8condOptions* opt, const char* charset) {
+  if (strcmp(charset,"latin1")==0) {
+    opt->repair=UTF8COND_REPAIR_LATIN1;
+  } else if (strcmp(charset,"cp1252")==0) {
+    opt->repair=UTF8COND_REPAIR_CP1252;
+  } else {
+    return(0);
+  }
+  return(1);
+}
+
+
+/* Create a conditioner with options opt. Output is passed to write and
+ * errors to error, either may be NULL. Returns NULL if out of memory.
+ */
+utf8cond* utf8condNew(const utf8condOptions* opt, utf8condWriteFn write,
+                      utf8condErrorFn error, void* ctx) {
+  utf8cond* c=(utf8cond*)calloc(1,sizeof(utf8cond));
+  if (c==NULL) {
+    return(NULL);
+  }
+  c->opt=*opt;
+  c->write=write;
+  c->report=error;
+  c->ctx=ctx;
+  c->checkEntities=(opt->checkXML1_0Chars || opt->checkXML1_1Chars);
+  c->decodeTrans=(opt->checkOverlong ? utf8StrictTrans : utf8LaxTrans);
+  c->entities=opt->entities;
+  if ((c->entities==NULL && (c->entities=c->ownEntities=predefinedEntities())==NULL) ||
+      !growBytes(c,BYTE_SIZE) || !growPend(c,2*MAX_BYTES)) {
+    utf8condFree(c);
+    return(NULL);
+  }
+  setupCodeChecks(c);
+  setupAsciiRun(c);
+  setupRepair(c);
+  setupValidator(c);
+  utf8condReset(c);
+  return(c);
+}
+
+
+/* Reset counters and state to start a new document with the same options */
+void utf8condReset(utf8cond* c) {
+  c->bytenum=0;
+  c->charnum=0;
+  c->linenum=1;
+  c->numErrors=0;
+  c->numChanged=0;
+  c->npend=0;
+  if (c->collectStats) {
+    utf8condCollectStats(c);
+  }
+}
+
+
+/* Condition the next len bytes of input. Bytes at the end which may be
+ * part of a character or entity reference continued in the next chunk
+ * are held over.
+ */
+void utf8condFeed(utf8cond* c, const unsigned char* buf, size_t len) {
+  size_t n, used;
+  while (c->npend>0) {
+    /* top up held bytes so the characters that start in them can be
+     * completed, then carry on from the same point in buf. An entity
+     * reference may need more, so top up by more each time round */
+    n=c->npend+2*MAX_BYTES;
+    if (n>len) { n=len; }
+    if (!growPend(c,c->npend+n)) {
+      /* out of memory, take what is held as the end */
+      utf8condFinish(c);
+      break;
+    }
+    memcpy(c->pend+c->npend,buf,n);
+    used=conditionBuffer(c,c->pend,c->npend+n,0);
+    if (used<c->npend) {
+      /* still not enough, the n bytes of buf are now held too */
+      c->npend+=n-used;
+      memmove(c->pend,c->pend+used,c->npend);
+      buf+=n;
+      len-=n;
+      if (len==0) {
+        return;
+      }
+      continue;
+    }
+    buf+=used-c->npend;
+    len-=used-c->npend;
+    c->npend=0;
+  }
+  used=conditionBuffer(c,buf,len,0);
+  if (!growPend(c,len-used)) {
+    used+=conditionBuffer(c,buf+used,len-used,1);
+  }
+  c->npend=len-used;
+  memcpy(c->pend,buf+used,c->npend);
+}
+
+
+/* Condition any held bytes as the end of input. Returns the number of
+ * errors found in the document.
+ */
+int utf8condFinish(utf8cond* c) {
+  conditionBuffer(c,c->pend,c->npend,1);
+  c->npend=0;
+  return(c->numErrors);
+}
+
+
+/* Set the position counters, for example to continue counting from the
+ * end of an earlier part of a document conditioned separately
+ */
+void utf8condSetPosition(utf8cond* c, unsigned long long line,
+                         unsigned long long chr, unsigned long long byte) {
+  c->linenum=line;
+  c->charnum=chr;
+  c->bytenum=byte;
+  c->startLine=line;
+  c->startChar=chr;
+}
+
+
+/* Get the state to carry on from later, for input that is appended to.
+ * state->held points to the bytes held over (part of a character or
+ * entity reference), valid until the next call other than this.
+ */
+void utf8condGetState(const utf8cond* c, utf8condState* state) {
+  state->line=c->linenum;
+  state->chr=c->charnum;
+  state->byte=c->bytenum;
+  state->numErrors=c->numErrors;
+  state->numChanged=c->numChanged;
+  state->held=c->pend;
+  state->nheld=c->npend;
+}
+
+
+/* Carry on from state, as from utf8condGetState() when the input so far
+ * was conditioned. The next byte fed follows the held bytes. Returns 0
+ * if out of memory.
+ */
+int utf8condSetState(utf8cond* c, const utf8condState* state) {
+  if (!growPend(c,state->nheld)) {
+    return(0);
+  }
+  utf8condSetPosition(c,state->line,state->chr,state->byte);
+  c->numErrors=state->numErrors;
+  c->numChanged=state->numChanged;
+  memmove(c->pend,state->held,state->nheld);
+  c->npend=state->nheld;
+  return(1);
+}
+
+
+/* Get the position counters, the line number and the number of
+ * characters and bytes read
+ */
+void utf8condPosition(const utf8cond* c, unsigned long long* line,
+                      unsigned long long* chr, unsigned long long* byte) {
+  *line=c->linenum;
+  *chr=c->charnum;
+  *byte=c->bytenum;
+}
+
+
+/* Start collecting stats, from zero */
+void utf8condCollectStats(utf8cond* c) {
+  c->collectStats=1;
+  memset(&c->stats,0,sizeof(c->stats));
+  c->startLine=c->linenum;
+  c->startChar=c->charnum;
+  c->fastTicks=0;
+  c->slowTicks=0;
+  c->startTicks=ticks();
+  c->startTime=seconds();
+}
+
+
+/* Get the stats collected so far, all zero unless utf8condCollectStats()
+ * was called */
+void utf8condGetStats(const utf8cond* c, utf8condStats* stats) {
+  unsigned long long t;
+  double perTick;
+
+  *stats=c->stats;
+  if (!c->collectStats) {
+    return;
+  }
+  stats->bytes=stats->fastBytes+stats->slowBytes;
+  stats->chars=c->charnum-c->startChar;
+  stats->lines=c->linenum-c->startLine;
+  t=ticks()-c->startTicks;
+  perTick=(t>0 ? (seconds()-c->startTime)/t : 0.0);
+  stats->fastSeconds=c->fastTicks*perTick;
+  stats->slowSeconds=c->slowTicks*perTick;
+}
+
+
+/* Find the first point at or after pos where buf can be split such that
+ * conditioning the two parts separately (with the position counters
+ * carried over) gives exactly the same output and errors as conditioning
+ * the whole. This is the start of a character (not a continuation byte)
+ * where the previous character is complete and which is not inside an
+ * entity reference (the name may be any length so this looks back).
+ * Returns len if there is no such point.
+ *
+ * With -m and XML1.0 checks the substitution depends on bytes left over
+ * from earlier characters so input is never split.
+ */
+size_t utf8condSplitPoint(const utf8condOptions* opt, const unsigned char* buf,
+                          size_t len, size_t pos) {
+  int checkEntities=(opt->checkXML1_0Chars || opt->checkXML1_1Chars);
+  size_t p;
+
+  if (opt->badMultiByteToMultiChar && opt->checkXML1_0Chars) {
+    return(len);
+  }
+  if (pos<MAX_BYTES) {
+    pos=MAX_BYTES;
+  }
+  for (; pos<len; pos++) {
+    if ((buf[pos]&0xC0)==0x80) {
+      continue;
+    }
+    if (checkEntities && inEntity(buf,pos)) {
+      /* skip to the byte that ends it, the split may be after that */
+      pos+=nameRun(buf+pos,len-pos);
+      continue;
+    }
+    /* last character start before pos, must have all its bytes */
+    for (p=pos-1; p>pos-7 && (buf[p]&0xC0)==0x80; p--);
+    if ((buf[p]&0xC0)==0x80 || utf8ContBytes[utf8ByteClass[buf[p]]]<=pos-p-1) {
+      return(pos);
+    }
+  }
+  return(len);
+}
+
+
+/* Number of errors found so far */
+int utf8condNumErrors(const utf8cond* c) {
+  return(c->numErrors);
+}
+
+
+/* Number of characters substituted or replaced by an NCR, if 0 the
+ * output is the same as the input */
+unsigned long int utf8condNumChanged(const utf8cond* c) {
+  return(c->numChanged);
+}
+
+
+void utf8condFree(utf8cond* c) {
+  utf8condNameSetFree(c->ownEntities);
+  free(c->byte);
+  free(c->pend);
+  free(c);
+}
+
+
+
+/* Go through input code (character) by code and check for correct use
+ * of UTF-8 continuation bytes, check for unicode character validity.
+ *
+ * Conditions the len bytes at in[] and returns the number of bytes
+ * consumed. Unless eof is set, stops before any character which might
+ * extend beyond the end of the buffer (a UTF-8 character is never longer
+ * than MAX_BYTES, an entity reference is held until its end is seen) so
+ * that the caller can supply more input. Runs of bytes that need no
+ * change are written out as single spans.
+ */
+static size_t conditionBuffer(utf8cond* c, const unsigned char* in, size_t len, int eof) {
+  int j,k;
+  int ch;
+  char buf[100];                  /* tmp used when building NCR */
+  int contBytes;                  /* number of continuation bytes (0-5) */
+  int entityRef;                  /* true if contBytes are an entity ref as opposed to a long UTF8 char */
+  unsigned int unicode;           /* Unicode character represented by UTF-8 */
+  int state;                      /* decoder state, see utf8tables.h */
+  int check;                      /* result of codeCheck() */
+  int repaired;                   /* true if the bad bytes were transcoded */
+  size_t pos=0;                   /* position of next byte to read */
+  size_t start;                   /* position of first byte of current char */
+  size_t span=0;                  /* start of run of bytes to copy unchanged */
+  size_t retry=0;                 /* position to next try vectorized validation */
+  size_t counted=0;               /* lines and chars are counted up to here */
+  size_t n;
+  unsigned long long mark=0, t;   /* ticks at the last change of path, for stats */
+
+  if (c->collectStats) {
+    mark=ticks();
+  }
+  while (pos<len && (eof || (len-pos)>=MAX_BYTES)) {
+    if (pos-counted>=COUNT_BLOCK) {
+      countPositions(c,in+counted,pos-counted);
+      counted=pos;
+    }
+#ifdef HAVE_SIMD_VALIDATOR
+    /* with -c, skip over valid chunks and only decode those with errors */
+    if (c->useValidator && pos>=retry && (len-pos)>=64) {
+      if (c->collectStats) {
+        t=ticks(); c->slowTicks+=t-mark; mark=t;
+      }
+      n=validRun(c,in+pos,len-pos);
+      pos+=n;
+      retry=pos+64;
+      if (c->collectStats) {
+        t=ticks(); c->fastTicks+=t-mark; mark=t;
+        c->stats.fastBytes+=n;
+      }
+      continue;
+    }
+#endif
+    /* skip over any run of clean ASCII, each byte is one char */
+    if (in[pos]<0x80 && c->asciiClean[in[pos]]) {
+      if (c->collectStats) {
+        t=ticks(); c->slowTicks+=t-mark; mark=t;
+      }
+      n=asciiRun(c,in+pos,len-pos);
+      pos+=n;
+      if (c->collectStats) {
+        t=ticks(); c->fastTicks+=t-mark; mark=t;
+        c->stats.fastBytes+=n;
+      }
+      continue;
+    }
+    start=pos;
+    ch=in[pos++];
+    if ((ch&0xC0)==0x80) {
+      c->charnum++; /* a stray continuation byte is a char too */
+    }
+    c->err.nparts=0; /* clear error */
+    /* Decode with the byte class and state tables of utf8tables.h:
+     *   0000 0000-0000 007F   0xxxxxxx
+     *   0000 0080-0000 07FF   110xxxxx 10xxxxxx
+     *   0000 0800-0000 FFFF   1110xxxx 10xxxxxx 10xxxxxx
+     *   0001 0000-001F FFFF   11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
+     *   0020 0000-03FF FFFF   111110xx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx
+     *   0400 0000-7FFF FFFF   1111110x 10xxxxxx ... 10xxxxxx
+     * Each step also tracks whether the code will be overlong, a surrogate
+     * or above 0x10FFFF so that no further checks are needed once the
+     * last continuation byte is read.
+     */
+    k=utf8ByteClass[ch];
+    state=c->decodeTrans[k];
+    contBytes=utf8ContBytes[k];
+    unicode=(ch&utf8LeadMask[k]);
+    if (state==UTF8_ILLEGAL) {
+      addPart(c,UTF8COND_ILLEGAL_BYTE,ch,0);
+    }
+    c->byte[0]=ch;
+
+    for (j=1; j<=contBytes; j++) {
+      if (pos<len) {
+        ch=in[pos++];
+	c->byte[j]=ch;
+        state=c->decodeTrans[state+utf8ByteClass[ch]];
+        if (state==UTF8_REJECT) {
+          /* doesn't match 10xxxxxx */
+          addPart(c,UTF8COND_NOT_CONTINUATION,j+1,0);
+	  pos--; /* restart at this byte */
+	  break;
+        }
+        unicode = (unicode << 6) + (ch&0x3F);
+      } else {
+        addPart(c,UTF8COND_PREMATURE_EOF,c->bytenum+pos,j);
+        break;
+      }
+    }
+
+    /* overlong encodings (never reached with -l) and illegal codes */
+    if (c->err.nparts==0) {
+      if (state==UTF8_OVERLONG) {
+        addPart(c,UTF8COND_OVERLONG,unicode,0);
+      } else if (state==UTF8_BAD) {
+        addPart(c,UTF8COND_ILLEGAL_CODE,unicode,0);
+      }
+    }
+
+    /* Attempt to read numeric character reference or entity reference if we
+     * have an ampersand (&) start character, e.g. &#123; for decimal,
+     * &#xABC; for hex
+     *
+     * http://www.w3.org/TR/2000/WD-xml-2e-20000814#dt-charref
+     *
+     * [66] CharRef ::= '&#' [0-9]+ ';' | '&#x' [0-9a-fA-F]+ ';'
+     *
+     * Well-formedness constraint: Legal Character
+     *
+     * Characters referred to using character references must match
+     * the production for Char.
+     *
+     * If the character reference begins with "&#x ", the digits and letters
+     * up to the terminating ; provide a hexadecimal representation of the
+     * character's code point in ISO/IEC 10646. If it begins just with "&#",
+     * the digits up to the terminating ; provide a decimal representation
+     * of the character's code point.
+     */
+    entityRef=0;
+    if (c->checkEntities && (c->byte[0]=='&')) {
+      /* The reference is '&' Name ';' or a numeric character reference
+       * '&#' digits ';' or '&#x' hex ';', see
+       * http://www.w3.org/TR/xml/#NT-EntityRef
+       * Find the end of the Name, or digits, with nameRun() and then
+       * check it. There is no limit on the length, if the end isn't in
+       * this chunk the whole reference is held for the next.
+       */
+      n=pos;
+      if (n<len && in[n]=='#') { n++; }
+      n+=nameRun(in+n,len-n);
+      /* nameRun() takes any byte from 0x80, the reference ends at the
+       * first that isn't part of a valid UTF-8 character */
+      k=0;
+      if ((j=(int)utf8Run(in+pos,n-pos,&k))<(int)(n-pos) && !(k && n==len && !eof)) {
+        n=pos+j;
+      }
+      if (n>=len && !eof) {
+        pos=start;
+        break;
+      }
+      entityRef=1;
+      if (!growBytes(c,n-start+3)) {
+        /* out of memory, read what fits */
+        n=start+c->maxByte-3;
+        addPart(c,UTF8COND_ENTITY_TOO_LONG,0,0);
+      }
+      for (j=1; pos<n; j++) {
+        c->byte[j]=in[pos++];
+      }
+      if (pos<len && in[pos]==';') {
+        c->byte[j++]=in[pos++];
+      } else {
+        /* not terminated, the next byte is not part of it */
+        if (pos>=len) {
+          addPart(c,UTF8COND_ENTITY_EOF,j,0);
+        } else if (in[pos]<32) {
+          addPart(c,UTF8COND_ENTITY_CONTROL,j,0);
+        } else {
+          addPart(c,UTF8COND_ENTITY_BAD_CHAR,in[pos],j);
+        }
+        c->byte[j++]=';';
+      }
+      /* the whole reference is one char, the rest aren't counted */
+      for (n=start+1; n<pos; n++) {
+        c->charnum-=((in[n]&0xC0)!=0x80);
+      }
+      contBytes=(j-1);
+      if (c->byte[1]=='#') {
+        if ((unicode=parseNumericCharacterReference(c->byte))==0) {
+          addPart(c,UTF8COND_BAD_NCR,contBytes,0);
+        }
+      } else if (!validEntity(c,in+start+1,contBytes-1)) {
+        addPart(c,UTF8COND_BAD_ENTITY,contBytes,0);
+      }
+    }
+
+    /* check for illegal Unicode chars from entity references and
+     * overlong forms that the decoder tables leave unchecked with -l */
+    if ((c->err.nparts==0) && (entityRef || state==UTF8_CHECK) && !validUTF8Char(unicode)) {
+      addPart(c,UTF8COND_ILLEGAL_CODE,unicode,0);
+    }
+
+    check=CHECK_OK;
+    if (c->err.nparts==0) {
+      check=codeCheck(c,unicode);
+      if (check==CHECK_XML1_0) {
+        addPart(c,UTF8COND_NOT_XML1_0,unicode,0);
+      } else if (check==CHECK_XML1_1) {
+        addPart(c,UTF8COND_NOT_XML1_1,unicode,0);
+      } else if (check==CHECK_BAD) {
+        addPart(c,UTF8COND_BAD_CODE,unicode,0);
+      }
+    }
+
+    /* keep the bytes read for the error record before any substitution */
+    if (c->err.nparts>0 || check==CHECK_RESTRICTED) {
+      for (k=0; k<UTF8COND_MAX_BYTES; k++) {
+        c->err.bytes[k]=(unsigned char)c->byte[k];
+      }
+      c->err.nbytes=(int)(pos-start);
+      c->err.code=(state==UTF8_REJECT || state==UTF8_ILLEGAL ||
+                   (entityRef && c->byte[1]!='#') ? -1 : (long int)unicode);
+      c->err.isError=(c->err.nparts>0);
+    }
+
+    repaired=0;
+    if (c->err.nparts>0) {
+      c->numErrors++;
+      c->numChanged++;
+      if (c->opt.repair && !entityRef && c->err.part[0].kind<=UTF8COND_ILLEGAL_CODE) {
+        /* bad UTF-8 (the kinds up to ILLEGAL_CODE), take each byte
+         * read as a char of the charset */
+        for (j=0, n=start; n<pos; n++) {
+          if (in[n]<0x80) {
+            c->byte[j++]=in[n];
+          } else {
+            for (k=0; k<c->repairLen[in[n]-0x80]; k++) {
+              c->byte[j++]=c->repairBytes[in[n]-0x80][k];
+            }
+          }
+        }
+        addPart(c,UTF8COND_REPAIRED,j,c->opt.repair);
+        repaired=1;
+      } else if (c->opt.badMultiByteToMultiChar && j>1) {
+        /* now test individual bytes of bad multibyte char, will always
+         * make substitution for at least the first char.
+         */
+        for (k=0; k<=j; k++) {
+          if (c->byte[k]>0x7F || (c->opt.checkXML1_0Chars && !validXML1_0Char((unsigned int)c->byte[j]))) {
+            c->byte[k]=c->opt.substituteChar;
+          }
+        }
+        addPart(c,UTF8COND_SUBSTITUTED_BYTES,j,0);
+      } else {
+        /* substitute one char for all bytes of bad multibyte char or entity reference
+         */
+        c->byte[0]=c->opt.substituteChar;
+        j=1;
+        addPart(c,UTF8COND_SUBSTITUTED,c->byte[0],0);
+      }
+    } else {
+      /* Finally check for restricted chars that we do a NCR substitution for */
+      if (check==CHECK_RESTRICTED) {
+        j=snprintf(buf,sizeof(buf),"&#x%X",unicode);
+        for (k=0; k<=j; k++) { c->byte[k]=(int)buf[k]; } /* copy char array to int array */
+        addPart(c,UTF8COND_RESTRICTED,unicode,0);
+        c->numChanged++;
+      }
+    }
+
+    if (c->collectStats) {
+      c->stats.slowBytes+=pos-start;
+      if (entityRef) {
+        c->stats.entities++;
+      } else {
+        c->stats.charBytes[(pos-start<6 ? pos-start : 6)]++;
+      }
+      if (c->err.nparts>0) {
+        c->stats.errors[c->err.part[0].kind]++;
+      }
+    }
+
+    if (c->err.nparts>0) {
+      if (c->report!=NULL && (c->numErrors<=c->opt.maxErrors || c->opt.maxErrors==0)) {
+        countPositions(c,in+counted,pos-counted);
+        counted=pos;
+        c->err.line=c->linenum;
+        c->err.chr=c->charnum;
+        c->err.byte=c->bytenum+pos;
+        for (k=0; k<j && k<UTF8COND_MAX_BYTES; k++) {
+          c->err.repl[k]=(unsigned char)c->byte[k];
+        }
+        c->err.nrepl=k;
+        c->report(c->ctx,&c->err);
+      }
+      contBytes=j-1;
+
+      /* bytes of this char have been changed, write out the unchanged
+       * span before it and then the replacement */
+      if (!c->opt.checkOnly) {
+        writeSpan(c,in+span,start-span);
+        writeBytes(c,c->byte,contBytes+1);
+      }
+      span=pos;
+
+      /* where there is one stray byte there are usually more, once no
+       * more messages are reported repair runs of them in bulk */
+      if (repaired && !c->collectStats &&
+          (c->report==NULL || (c->opt.maxErrors>0 && c->numErrors>=c->opt.maxErrors))) {
+        pos+=repairRun(c,in+pos,len-pos,c->opt.checkOnly);
+        span=pos;
+      }
+    }
+  }
+
+  if (!c->opt.checkOnly) {
+    writeSpan(c,in+span,pos-span);
+  }
+  countPositions(c,in+counted,pos-counted);
+  c->bytenum+=pos;
+  if (c->collectStats) {
+    c->slowTicks+=ticks()-mark;
+  }
+  return(pos);
+}
+
+
+/* Clock for timing the fast and slow paths for stats, the time stamp
+ * counter if there is one as it is much cheaper to read */
+static unsigned long long ticks(void) {
+#ifdef HAVE_TSC
+  return(__rdtsc());
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return((unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec);
+#endif
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return(ts.tv_sec+ts.tv_nsec/1e9);
+}
+
+
+/* Fill in codeChecks[] for the options set */
+static void setupCodeChecks(utf8cond* c) {
+  int cls;
+  for (cls=0; cls<16; cls++) {
+    if (c->opt.checkXML1_0Chars && (cls&UTF8_CODE_XML1_0)) {
+      c->codeChecks[cls]=CHECK_XML1_0;
+    } else if (c->opt.checkXML1_1Chars && (cls&UTF8_CODE_XML1_1)) {
+      c->codeChecks[cls]=CHECK_XML1_1;
+    } else if (cls&CODE_BAD) {
+      c->codeChecks[cls]=CHECK_BAD;
+    } else if (c->opt.checkXML1_1Restricted && (cls&UTF8_CODE_RESTRICTED)) {
+      c->codeChecks[cls]=CHECK_RESTRICTED;
+    } else {
+      c->codeChecks[cls]=CHECK_OK;
+    }
+  }
+}
+
+/* The check that code fails, CHECK_OK if none */
+static int codeCheck(const utf8cond* c, unsigned int code) {
+  int cls;
+  if (code<0x10000) {
+    cls=utf8CodeClassBMP[code];
+  } else if (code<=0x10FFFF) {
+    cls=utf8CodeClassPlaneBlock[utf8CodeClassPlaneIndex[(code-0x10000)>>8]][code&0xFF];
+  } else {
+    cls=UTF8_CODE_XML1_0|UTF8_CODE_XML1_1;
+  }
+  if (c->opt.badCodes!=NULL && utf8condCodeSetHas(c->opt.badCodes,code)) {
+    cls|=CODE_BAD;
+  }
+  return(c->codeChecks[cls]);
+}
+
+
+/* Work out which ASCII bytes are always clean with the options set,
+ * i.e. would pass through the checks in conditionBuffer() unchanged
+ * and without error.
+ */
+static void setupAsciiRun(utf8cond* c) {
+  unsigned int b;
+  c->asciiSimd=1;
+  for (b=0; b<128; b++) {
+    c->asciiClean[b]=!((c->checkEntities && b=='&') || codeCheck(c,b)!=CHECK_OK);
+    if (!c->asciiClean[b] && ((b>=0x20 && b<0x7F && b!='&') ||
+                           b=='\t' || b=='\n' || b=='\r')) {
+      c->asciiSimd=0;
+    }
+  }
+}
+
+
+/* Returns the length of the run of clean ASCII bytes at the start of
+ * s[0..n-1].
+ *
+ * With SIMD, blocks are tested for candidate bytes (high bit set, control
+ * other than tab/LF/CR, '&' or DEL) and only candidates are looked up
+ * in asciiClean[].
+ */
+static size_t asciiRun(utf8cond* c, const unsigned char* s, size_t n) {
+  size_t i=0;
+#if defined(__AVX2__)
+  const __m256i amp=_mm256_set1_epi8('&'), del=_mm256_set1_epi8(0x7F);
+  const __m256i sp=_mm256_set1_epi8(0x1F), lf=_mm256_set1_epi8('\n');
+  const __m256i tab=_mm256_set1_epi8('\t'), cr=_mm256_set1_epi8('\r');
+  __m256i v, m;
+  unsigned int mask;
+  if (c->asciiSimd) {
+    while (i+32<=n) {
+      v=_mm256_loadu_si256((const __m256i*)(s+i));
+      /* controls: unsigned v<=0x1F, excluding tab/LF/CR */
+      m=_mm256_cmpeq_epi8(_mm256_min_epu8(v,sp),v);
+      m=_mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v,tab),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v,lf),_mm256_cmpeq_epi8(v,cr))),m);
+      m=_mm256_or_si256(m,_mm256_or_si256(_mm256_cmpeq_epi8(v,amp),_mm256_cmpeq_epi8(v,del)));
+      mask=(unsigned int)(_mm256_movemask_epi8(m) | _mm256_movemask_epi8(v));
+      if (mask!=0) {
+        i+=__builtin_ctz(mask);
+        if (s[i]>=0x80 || !c->asciiClean[s[i]]) {
+          return(i);
+        }
+        i++;
+        continue;
+      }
+      i+=32;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i amp=_mm_set1_epi8('&'), del=_mm_set1_epi8(0x7F);
+  const __m128i sp=_mm_set1_epi8(0x1F), lf=_mm_set1_epi8('\n');
+  const __m128i tab=_mm_set1_epi8('\t'), cr=_mm_set1_epi8('\r');
+  __m128i v, m;
+  unsigned int mask;
+  if (c->asciiSimd) {
+    while (i+16<=n) {
+      v=_mm_loadu_si128((const __m128i*)(s+i));
+      /* controls: unsigned v<=0x1F, excluding tab/LF/CR */
+      m=_mm_cmpeq_epi8(_mm_min_epu8(v,sp),v);
+      m=_mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v,tab),
+            _mm_or_si128(_mm_cmpeq_epi8(v,lf),_mm_cmpeq_epi8(v,cr))),m);
+      m=_mm_or_si128(m,_mm_or_si128(_mm_cmpeq_epi8(v,amp),_mm_cmpeq_epi8(v,del)));
+      mask=(unsigned int)(_mm_movemask_epi8(m) | _mm_movemask_epi8(v));
+      if (mask!=0) {
+        i+=__builtin_ctz(mask);
+        if (s[i]>=0x80 || !c->asciiClean[s[i]]) {
+          return(i);
+        }
+        i++;
+        continue;
+      }
+      i+=16;
+    }
+  }
+#endif
+  for (; i<n && s[i]<0x80 && c->asciiClean[s[i]]; i++);
+  return(i);
+}
+
+
+/* Fill in repairBytes[] and repairLen[] for opt.repair. Latin-1 bytes
+ * are the codes 0x80-0xFF, Windows-1252 differs in 0x80-0x9F where the
+ * five bytes it leaves undefined are taken as C1 controls (as browsers
+ * do). A code that would fail the checks (C1 controls are restricted in
+ * XML1.1, or a -b code) is replaced with the substitute character.
+ */
+static void setupRepair(utf8cond* c) {
+  static const unsigned short cp1252[32]={
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178 };
+  unsigned int b, code;
+
+  for (b=0x80; b<=0xFF; b++) {
+    code=(c->opt.repair==UTF8COND_REPAIR_CP1252 && b<0xA0 ? cp1252[b-0x80] : b);
+    if (codeCheck(c,code)!=CHECK_OK) {
+      c->repairBytes[b-0x80][0]=(unsigned char)c->opt.substituteChar;
+      c->repairLen[b-0x80]=1;
+    } else if (code<0x800) {
+      c->repairBytes[b-0x80][0]=(unsigned char)(0xC0|(code>>6));
+      c->repairBytes[b-0x80][1]=(unsigned char)(0x80|(code&0x3F));
+      c->repairLen[b-0x80]=2;
+    } else {
+      c->repairBytes[b-0x80][0]=(unsigned char)(0xE0|(code>>12));
+      c->repairBytes[b-0x80][1]=(unsigned char)(0x80|((code>>6)&0x3F));
+      c->repairBytes[b-0x80][2]=(unsigned char)(0x80|(code&0x3F));
+      c->repairLen[b-0x80]=3;
+    }
+  }
+}
+
+
+/* Transcode the run at the start of s[0..n-1] of clean ASCII and bytes
+ * 0x80-0xFF that each stand alone between ASCII bytes, as in text in
+ * an 8-bit charset, and return its length. Each high byte is a char
+ * that is an error and is repaired, exactly as the decode loop would,
+ * so this is only used when no messages are reported for them.
+ *
+ * With SIMD, blocks with no unclean ASCII and no two high bytes
+ * together are found with compares as in asciiRun() and only the high
+ * bytes in them are looked up. The run ends at a block with no high
+ * bytes, ASCII is better passed over by asciiRun().
+ */
+static size_t repairRun(utf8cond* c, const unsigned char* s, size_t n, const int checkOnly) {
+  unsigned char out[3*REPAIR_BLOCK+3*16];
+  size_t i=0, m=0;
+  unsigned long int errors=0, stray=0;
+  unsigned int b, k, high;
+#if defined(__SSE2__)
+  const __m128i amp=_mm_set1_epi8('&'), del=_mm_set1_epi8(0x7F);
+  const __m128i sp=_mm_set1_epi8(0x1F), lf=_mm_set1_epi8('\n');
+  const __m128i tab=_mm_set1_epi8('\t'), cr=_mm_set1_epi8('\r');
+  __m128i v, u;
+#endif
+
+  while (i<n) {
+    if (m>=3*REPAIR_BLOCK) {
+      if (!checkOnly) {
+        writePieces(c,out,m);
+      }
+      m=0;
+    }
+#if defined(__SSE2__)
+    if (c->asciiSimd && i+17<=n) {
+      v=_mm_loadu_si128((const __m128i*)(s+i));
+      /* controls: unsigned v<=0x1F, excluding tab/LF/CR */
+      u=_mm_cmpeq_epi8(_mm_min_epu8(v,sp),v);
+      u=_mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v,tab),
+            _mm_or_si128(_mm_cmpeq_epi8(v,lf),_mm_cmpeq_epi8(v,cr))),u);
+      u=_mm_or_si128(u,_mm_or_si128(_mm_cmpeq_epi8(v,amp),_mm_cmpeq_epi8(v,del)));
+      high=(unsigned int)_mm_movemask_epi8(v);
+      if (high==0) {
+        break; /* back to asciiRun(), which needs no copy */
+      }
+      if (_mm_movemask_epi8(u)==0 &&
+          (high&(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s+i+1))))==0) {
+        for (k=0; k<16; k++) {
+          b=s[i+k];
+          if (b<0x80) {
+            out[m++]=(unsigned char)b;
+          } else {
+            memcpy(out+m,c->repairBytes[b-0x80],3);
+            m+=c->repairLen[b-0x80];
+            stray+=(b<0xC0);
+          }
+        }
+        errors+=__builtin_popcount(high);
+        i+=16;
+        continue;
+      }
+    }
+#endif
+    b=s[i];
+    if (b<0x80) {
+      if (!c->asciiClean[b]) {
+        break;
+      }
+      out[m++]=(unsigned char)b;
+    } else {
+      if (i+1>=n || s[i+1]>=0x80) {
+        break;
+      }
+      memcpy(out+m,c->repairBytes[b-0x80],3);
+      m+=c->repairLen[b-0x80];
+      stray+=(b<0xC0);
+      errors++;
+    }
+    i++;
+  }
+  if (m>0 && !checkOnly) {
+    writePieces(c,out,m);
+  }
+  c->numErrors+=(int)errors;
+  c->numChanged+=errors;
+  c->charnum+=stray; /* stray continuation bytes, see countPositions() */
+  return(i);
+}
+
+
+/* Add the number of lines and chars in s[0..n-1] to the counters. Chars
+ * are counted as bytes that are not continuation bytes, which is right
+ * for all input conditionBuffer() has done up to s+n except stray
+ * continuation bytes and entity references, each one char, for which
+ * it corrects charnum itself. Counting is left until a block of COUNT_BLOCK
+ * has been conditioned, the end of the buffer or an error is reported,
+ * so the decode loop only keeps its position in the buffer.
+ */
+static void countPositions(utf8cond* c, const unsigned char* s, size_t n) {
+  size_t i=0, end;
+  unsigned long long nl=0, nc=0;
+#if defined(__AVX2__)
+  const __m256i lf=_mm256_set1_epi8('\n'), notCont=_mm256_set1_epi8((char)0xBF);
+  const __m256i zero=_mm256_setzero_si256();
+  __m256i v, lines, chars;
+  /* count in byte lanes, 255 blocks at most, then add up the lanes */
+  while (i+32<=n) {
+    end=(n-i)/32<255 ? i+(n-i)/32*32 : i+255*32;
+    lines=zero; chars=zero;
+    for (; i<end; i+=32) {
+      v=_mm256_loadu_si256((const __m256i*)(s+i));
+      lines=_mm256_sub_epi8(lines,_mm256_cmpeq_epi8(v,lf));
+      /* signed compare >0xBF is ASCII or a lead byte */
+      chars=_mm256_sub_epi8(chars,_mm256_cmpgt_epi8(v,notCont));
+    }
+    lines=_mm256_sad_epu8(lines,zero);
+    chars=_mm256_sad_epu8(chars,zero);
+    nl+=_mm256_extract_epi64(lines,0)+_mm256_extract_epi64(lines,1)+
+        _mm256_extract_epi64(lines,2)+_mm256_extract_epi64(lines,3);
+    nc+=_mm256_extract_epi64(chars,0)+_mm256_extract_epi64(chars,1)+
+        _mm256_extract_epi64(chars,2)+_mm256_extract_epi64(chars,3);
+  }
+#elif defined(__SSE2__)
+  const __m128i lf=_mm_set1_epi8('\n'), notCont=_mm_set1_epi8((char)0xBF);
+  const __m128i zero=_mm_setzero_si128();
+  __m128i v, lines, chars;
+  /* count in byte lanes, 255 blocks at most, then add up the lanes */
+  while (i+16<=n) {
+    end=(n-i)/16<255 ? i+(n-i)/16*16 : i+255*16;
+    lines=zero; chars=zero;
+    for (; i<end; i+=16) {
+      v=_mm_loadu_si128((const __m128i*)(s+i));
+      lines=_mm_sub_epi8(lines,_mm_cmpeq_epi8(v,lf));
+      /* signed compare >0xBF is ASCII or a lead byte */
+      chars=_mm_sub_epi8(chars,_mm_cmpgt_epi8(v,notCont));
+    }
+    lines=_mm_sad_epu8(lines,zero);
+    chars=_mm_sad_epu8(chars,zero);
+    nl+=(unsigned long long)_mm_cvtsi128_si32(lines)+(unsigned long long)_mm_extract_epi16(lines,4);
+    nc+=(unsigned long long)_mm_cvtsi128_si32(chars)+(unsigned long long)_mm_extract_epi16(chars,4);
+  }
+#endif
+  for (; i<n; i++) {
+    nl+=(s[i]=='\n');
+    nc+=((s[i]&0xC0)!=0x80);
+  }
+  c->linenum+=nl;
+  c->charnum+=nc;
+}
+
+
+/* Decide whether to use vectorized validation and set up asciiNibbles[]
+ * from asciiClean[], which must already be set.
+ */
+static void setupValidator(utf8cond* c) {
+  unsigned int b;
+  for (b=0; b<128; b++) {
+    if (!c->asciiClean[b]) {
+      c->asciiNibbles[b&0x0F]|=(unsigned char)(1<<(b>>4));
+    }
+  }
+  c->useValidator=(c->opt.checkOnly && (c->opt.badCodes==NULL || !c->opt.badCodes->nonAscii));
+#ifdef HAVE_SIMD_VALIDATOR
+  if (!__builtin_cpu_supports("ssse3")) {
+    c->useValidator=0;
+  }
+#else
+  c->useValidator=0;
+#endif
+}
+
+
+#ifdef HAVE_SIMD_VALIDATOR
+/* Vectorized UTF-8 validation for -c, using the nibble lookup table
+ * method of Keiser and Lemire ("Validating UTF-8 In Less Than One
+ * Instruction Per Byte", 2021). Three 16 entry tables indexed by the
+ * high and low nibbles of the previous byte and the high nibble of the
+ * current byte give a set of possible error bits, any bit set in all
+ * three is an error. The errors found are exactly those of RFC3629:
+ * bad lead bytes, missing or extra continuation bytes, overlong
+ * encodings, surrogates and codes above 0x10FFFF.
+ */
+#define V_TOO_SHORT   (1<<0)
+#define V_TOO_LONG    (1<<1)
+#define V_OVERLONG_3  (1<<2)
+#define V_TOO_LARGE   (1<<3)
+#define V_SURROGATE   (1<<4)
+#define V_OVERLONG_2  (1<<5)
+#define V_TOO_LARGE_1000 (1<<6)
+#define V_OVERLONG_4  (1<<6)
+#define V_TWO_CONTS   (1<<7)
+#define V_CARRY (V_TOO_SHORT | V_TOO_LONG | V_TWO_CONTS)
+
+/* Error bits for UTF-8 errors and XML checks in one 16 byte block
+ * v, given the previous block prev. asciiLo is indexed by low nibble
+ * and has bit h set if the ASCII byte with high nibble h is not clean
+ * with the current options.
+ */
+__attribute__((target("ssse3")))
+static __m128i validateBlock(utf8cond* c, __m128i v, __m128i prev, __m128i asciiLo) {
+  const __m128i lowNibble=_mm_set1_epi8(0x0F);
+  const __m128i byte1High=_mm_setr_epi8(
+    V_TOO_LONG, V_TOO_LONG, V_TOO_LONG, V_TOO_LONG,
+    V_TOO_LONG, V_TOO_LONG, V_TOO_LONG, V_TOO_LONG,
+    V_TWO_CONTS, V_TWO_CONTS, V_TWO_CONTS, V_TWO_CONTS,
+    V_TOO_SHORT | V_OVERLONG_2,
+    V_TOO_SHORT,
+    V_TOO_SHORT | V_OVERLONG_3 | V_SURROGATE,
+    V_TOO_SHORT | V_TOO_LARGE | V_TOO_LARGE_1000 | V_OVERLONG_4);
+  const __m128i byte1Low=_mm_setr_epi8(
+    V_CARRY | V_OVERLONG_3 | V_OVERLONG_2 | V_OVERLONG_4,
+    V_CARRY | V_OVERLONG_2,
+    V_CARRY,
+    V_CARRY,
+    V_CARRY | V_TOO_LARGE,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000 | V_SURROGATE,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000,
+    V_CARRY | V_TOO_LARGE | V_TOO_LARGE_1000);
+  const __m128i byte2High=_mm_setr_epi8(
+    V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT,
+    V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT,
+    V_TOO_LONG | V_OVERLONG_2 | V_TWO_CONTS | V_OVERLONG_3 | V_TOO_LARGE_1000 | V_OVERLONG_4,
+    V_TOO_LONG | V_OVERLONG_2 | V_TWO_CONTS | V_OVERLONG_3 | V_TOO_LARGE,
+    V_TOO_LONG | V_OVERLONG_2 | V_TWO_CONTS | V_SURROGATE | V_TOO_LARGE,
+    V_TOO_LONG | V_OVERLONG_2 | V_TWO_CONTS | V_SURROGATE | V_TOO_LARGE,
+    V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT, V_TOO_SHORT);
+  const __m128i highBit=_mm_setr_epi8(1,2,4,8,16,32,64,-128,0,0,0,0,0,0,0,0);
+  __m128i prev1, prev2, prev3, hi, err, must23, x;
+
+  prev1=_mm_alignr_epi8(v,prev,15);
+  hi=_mm_and_si128(_mm_srli_epi16(v,4),lowNibble);
+  err=_mm_and_si128(
+        _mm_and_si128(
+          _mm_shuffle_epi8(byte1High,_mm_and_si128(_mm_srli_epi16(prev1,4),lowNibble)),
+          _mm_shuffle_epi8(byte1Low,_mm_and_si128(prev1,lowNibble))),
+        _mm_shuffle_epi8(byte2High,hi));
+  prev2=_mm_alignr_epi8(v,prev,14);
+  prev3=_mm_alignr_epi8(v,prev,13);
+  must23=_mm_or_si128(_mm_subs_epu8(prev2,_mm_set1_epi8((char)(0xE0-0x80))),
+                      _mm_subs_epu8(prev3,_mm_set1_epi8((char)(0xF0-0x80))));
+  err=_mm_xor_si128(err,_mm_and_si128(must23,_mm_set1_epi8((char)0x80)));
+
+  /* ASCII bytes that are not clean, by nibble bitmap */
+  x=_mm_and_si128(_mm_shuffle_epi8(asciiLo,_mm_and_si128(v,lowNibble)),
+                  _mm_shuffle_epi8(highBit,hi));
+  err=_mm_or_si128(err,x);
+  if (c->opt.checkXML1_0Chars || c->opt.checkXML1_1Chars) {
+    /* U+FFFE and U+FFFF: EF BF BE and EF BF BF */
+    x=_mm_and_si128(_mm_cmpeq_epi8(prev2,_mm_set1_epi8((char)0xEF)),
+                    _mm_cmpeq_epi8(prev1,_mm_set1_epi8((char)0xBF)));
+    x=_mm_and_si128(x,_mm_cmpeq_epi8(_mm_max_epu8(v,_mm_set1_epi8((char)0xBE)),v));
+    err=_mm_or_si128(err,x);
+  }
+  if (c->opt.checkXML1_1Restricted) {
+    /* restricted codes 0x80-0xBF except 0x85: C2 80 to C2 BF */
+    x=_mm_andnot_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8((char)0x85)),
+                       _mm_cmpeq_epi8(prev1,_mm_set1_epi8((char)0xC2)));
+    err=_mm_or_si128(err,x);
+  }
+  return(err);
+}
+
+/* Returns the length of the prefix of s[0..n-1] which is valid UTF-8 and
+ * would produce no errors, ending on a character boundary. Checks 64 byte
+ * chunks and stops at the first chunk with a possible error.
+ */
+__attribute__((target("ssse3")))
+static size_t validRun(utf8cond* c, const unsigned char* s, size_t n) {
+  const __m128i incompleteMax=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                            (char)(0xF0-1),(char)(0xE0-1),(char)(0xC0-1));
+  __m128i asciiLo=_mm_loadu_si128((const __m128i*)c->asciiNibbles);
+  __m128i prev=_mm_setzero_si128();
+  __m128i prevIncomplete=_mm_setzero_si128();
+  __m128i v[4], err, p;
+  size_t i=0, end;
+  int k;
+
+  while (i+64<=n) {
+    err=_mm_setzero_si128();
+    p=prev;
+    for (k=0; k<4; k++) {
+      v[k]=_mm_loadu_si128((const __m128i*)(s+i+16*k));
+      err=_mm_or_si128(err,validateBlock(c,v[k],p,asciiLo));
+      p=v[k];
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(err,_mm_setzero_si128()))!=0xFFFF) {
+      break;
+    }
+    prev=p;
+    prevIncomplete=_mm_subs_epu8(p,incompleteMax);
+    i+=64;
+  }
+  if (i>0 && _mm_movemask_epi8(_mm_cmpeq_epi8(prevIncomplete,_mm_setzero_si128()))!=0xFFFF) {
+    /* back up to start of the incomplete character at the end */
+    end=i-1;
+    while ((s[end]&0xC0)==0x80) { end--; }
+    i=end;
+  }
+  return(i);
+}
+#endif
+
+
+/* Pass n bytes starting at s to the output callback */
+static void writeSpan(utf8cond* c, const unsigned char* s, size_t n) {
+  if (n>0 && c->write!=NULL) {
+    c->write(c->ctx,s,n);
+  }
+}
+
+/* Write n bytes at s that are not in the input, in pieces no longer
+ * than UTF8COND_MAX_BYTES (see utf8condWriteFn) */
+static void writePieces(utf8cond* c, const unsigned char* s, size_t n) {
+  size_t m;
+  for (; n>0; s+=m, n-=m) {
+    m=(n<UTF8COND_MAX_BYTES ? n : UTF8COND_MAX_BYTES);
+    writeSpan(c,s,m);
+  }
+}
+
+/* Write the n bytes held as ints in b[], a long entity reference may
+ * take more than one piece */
+static void writeBytes(utf8cond* c, const int* b, int n) {
+  unsigned char s[MAX_BYTES];
+  int k, m;
+  for (; n>0; b+=m, n-=m) {
+    m=(n<MAX_BYTES ? n : MAX_BYTES);
+    for (k=0; k<m; k++) {
+      s[k]=(unsigned char)b[k];
+    }
+    writeSpan(c,s,m);
+  }
+}
+
+
+/* Returns true unless the character is one of a small set of codes
+ * that do not represent legal characters in Unicode.
+ *
+ * From Unicode 3.2 (http://www.unicode.org/unicode/reports/tr28/#3_1_conformance) 
+ * UxD800..UxDFFF are ill-formed 
+ *
+ * UTF-8 is defined by http://www.ietf.org/rfc/rfc3629.txt
+ * (and obsoletes http://www.ietf.org/rfc/rfc2279.txt which, in turn
+ * obsoletes http://www.ietf.org/rfc/rfc2044.txt )
+ *
+ * Ux10FFFF is highest legal UTF-8 code
+ * RFC2279 permitted codes greater than Ux10FFFF but RFC3629 does not. 
+ */
+int validUTF8Char(unsigned int ch) {
+  return((ch<0xD800 || ch>0xDFFF) && ch<=0x10FFFF);
+}
+
+
+/* From http://www.w3.org/TR/2000/REC-xml-20001006 
+ * (sec 2.2, extracted 16July2001)
+ *
+ * Legal characters are tab, carriage return, line feed, and the legal 
+ * characters of Unicode and ISO/IEC 10646. The versions of these standards 
+ * cited in A.1 Normative References were current at the time this document 
+ * was prepared. New characters may be added to these standards by amendments 
+ * or new editions. Consequently, XML processors must accept any character 
+ * in the range specified for Char. The use of "compatibility characters", 
+ * as defined in section 6.8 of [Unicode] (see also D21 in section 3.6 of 
+ * [Unicode3]), is discouraged.]
+ *
+ * Character Range
+ * Char ::= #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] |
+ *                            [#x10000-#x10FFFF]
+ * [end excerpt]
+ */
+int validXML1_0Char(unsigned int ch) {
+  return(ch==0x09 || ch==0x0A || ch==0x0D ||
+         (ch>=0x20 && ch<=0xD7FF) ||
+         (ch>=0xE000 && ch<=0xFFFD) ||
+         (ch>=0x10000 && ch<=0x10FFFF)); 
+} 
+
+
+/* From http://www.w3.org/TR/xml11/#charsets
+ * (sec 2.2, extracted 23Dec2003)
+ * 
+ * Char ::=  [#x1-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]  
+ * RestrictedChar ::= [#x1-#x8] | [#xB-#xC] | [#xE-#x1F] | 
+ *                    [#x7F-#x84] | [#x86-#xBF]
+ *
+ * Spec doesn't seem to say what one should do about RestricterChar.
+ * However, http://www.w3.org/International/questions/qa-controls.html
+ * says:
+ *
+ * In XML 1.1 (which is still in Candidate Recommendation stage), if you 
+ * need to represent a control code explicitly the simplest alternative 
+ * is to use an NCR (numeric character reference). For example, the control 
+ * code ESC (Escape) U+001B would be represented by either the &#x1B; 
+ * (hexadecimal) or &#27; (decimal) Numeric Character References.
+ *
+ */
+int validXML1_1Char(unsigned int ch) {
+  return((ch>=0x1 && ch<=0xD7FF) ||
+         (ch>=0xE000 && ch<=0xFFFD) ||
+         (ch>=0x10000 && ch<=0x10FFFF)); 
+} 
+
+int restrictedXML1_1Char(unsigned int ch) {
+  return((ch>=0x1 && ch<=0x8) ||
+         (ch>=0xB && ch<=0xC) ||
+         (ch>=0xE && ch<=0x1F) ||
+         (ch>=0x7F && ch<=0x84) ||
+         (ch>=0x86 && ch<=0xBF));
+} 
+
+
+/* Parse a numeric character reference in either decimal or hex
+ * notation. Expects b[] to start with codes for &# and to be 
+ * terminated with ;
+ *
+ * Returns: unicode code point on success
+ *          0                  on failure 
+ *
+ * Note that #x0 is not a valid XML Char and so can safely be used 
+ * as the failure return value. Values too large to hold are returned
+ * as 0xFFFFFFFF which is not a valid Char either.
+ * See http://www.w3.org/TR/2000/WD-xml-2e-20000814#sec-references
+ */
+unsigned int parseNumericCharacterReference(int b[]) {
+  int j;
+  unsigned int unicode=0;
+  int big=0;                      /* true once too large */
+  if (b[2]=='x') {
+    /* hex */
+    for (j=3; b[j]!=';'; j++) {
+      if (unicode>0x0FFFFFFF) { big=1; }
+      unicode*=16;
+      if (b[j]>='0' && b[j]<='9') {
+        unicode+=b[j]-'0';
+      } else if (b[j]>='a' && b[j]<='f') {
+        unicode+=b[j]-'a'+10;
+      } else if (b[j]>='A' && b[j]<='F') {
+        unicode+=b[j]-'A'+10;
+      } else {
+        return(0);
+      } 
+    }
+  } else {
+    /* decimal */
+    for (j=2; b[j]!=';'; j++) {
+      if (unicode>0x0FFFFFFF) { big=1; }
+      unicode*=10;
+      if (b[j]>='0' && b[j]<='9') {
+        unicode+=b[j]-'0';
+      } else {
+        return(0);
+      } 
+    }
+  }
+  return(big && unicode!=0 ? 0xFFFFFFFF : unicode);
+}
+
+
+/* Returns true if name[0..len-1] is an entity that may be referred to,
+ * one of the 5 XML predefined entities
+ *   &amp; &apos; &quot; &gt; &lt;
+ * or one added with utf8condAddEntity(). Names that aren't valid XML
+ * Names are never added so only need checking if not found.
+ */
+static int validEntity(const utf8cond* c, const unsigned char* name, size_t len) {
+  return(utf8condNameSetHas(c->entities,name,len));
+}
+
+
+/* Returns true if code u is an XML NameStartChar (first set) or
+ * NameChar, see http://www.w3.org/TR/xml/#NT-Name
+ */
+static int nameChar(unsigned int u, int first) {
+  if ((u>='a' && u<='z') || (u>='A' && u<='Z') || u=='_' || u==':' ||
+      (u>=0xC0 && u<=0xD6) || (u>=0xD8 && u<=0xF6) || (u>=0xF8 && u<=0x2FF) ||
+      (u>=0x370 && u<=0x37D) || (u>=0x37F && u<=0x1FFF) || (u>=0x200C && u<=0x200D) ||
+      (u>=0x2070 && u<=0x218F) || (u>=0x2C00 && u<=0x2FEF) || (u>=0x3001 && u<=0xD7FF) ||
+      (u>=0xF900 && u<=0xFDCF) || (u>=0xFDF0 && u<=0xFFFD) || (u>=0x10000 && u<=0xEFFFF)) {
+    return(1);
+  }
+  return(!first && ((u>='0' && u<='9') || u=='-' || u=='.' || u==0xB7 ||
+                    (u>=0x300 && u<=0x36F) || (u>=0x203F && u<=0x2040)));
+}
+
+
+/* Returns true if name[0..len-1] is valid UTF-8 and an XML Name */
+int utf8condValidName(const unsigned char* name, size_t len) {
+  size_t j=0, start;
+  int k, n, state;
+  unsigned int u;
+
+  if (len==0) {
+    return(0);
+  }
+  while (j<len) {
+    start=j;
+    k=utf8ByteClass[name[j]];
+    state=utf8StrictTrans[k];
+    u=(name[j++]&utf8LeadMask[k]);
+    for (n=utf8ContBytes[k]; n>0 && j<len; n--) {
+      state=utf8StrictTrans[state+utf8ByteClass[name[j]]];
+      u=(u<<6)|(name[j++]&0x3F);
+    }
+    if (n>0 || state!=UTF8_OK || !nameChar(u,(start==0))) {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+
+/* Returns the length of the run at the start of s[0..n-1] of whole valid
+ * UTF-8 characters, with *partial set if it ends at the start of one cut
+ * off at n */
+static size_t utf8Run(const unsigned char* s, size_t n, int* partial) {
+  size_t j=0, i;
+  int k, cont, state;
+
+  while (j<n) {
+    if (s[j]<0x80) {
+      j++;
+      continue;
+    }
+    k=utf8ByteClass[s[j]];
+    state=utf8StrictTrans[k];
+    for (i=j+1, cont=utf8ContBytes[k]; cont>0 && i<n && state!=UTF8_ILLEGAL; cont--, i++) {
+      state=utf8StrictTrans[state+utf8ByteClass[s[i]]];
+    }
+    if (state==UTF8_ILLEGAL || state==UTF8_REJECT) {
+      return(j);
+    }
+    if (cont>0) {
+      *partial=1;
+      return(j);
+    }
+    if (state!=UTF8_OK) {
+      return(j);
+    }
+    j=i;
+  }
+  return(j);
+}
+
+
+/* Returns the length of the run of bytes at the start of s[0..n-1] that
+ * may be part of a Name (see utf8NameByte[]), vectorized as asciiRun()
+ * as most names are short but the run may be long.
+ */
+static size_t nameRun(const unsigned char* s, size_t n) {
+  size_t i=0;
+#if defined(__SSE2__)
+  const __m128i lo=_mm_set1_epi8('a'-1), hi=_mm_set1_epi8('z'+1);
+  const __m128i d0=_mm_set1_epi8('0'-1), d9=_mm_set1_epi8('9'+1);
+  const __m128i bit=_mm_set1_epi8(0x20);
+  const __m128i dot=_mm_set1_epi8('.'), dash=_mm_set1_epi8('-');
+  const __m128i us=_mm_set1_epi8('_'), colon=_mm_set1_epi8(':');
+  __m128i v, l, m;
+  unsigned int mask;
+  while (i+16<=n) {
+    v=_mm_loadu_si128((const __m128i*)(s+i));
+    /* signed compares, bytes from 0x80 are negative and taken by movemask */
+    l=_mm_or_si128(v,bit);
+    m=_mm_and_si128(_mm_cmpgt_epi8(l,lo),_mm_cmpgt_epi8(hi,l));
+    m=_mm_or_si128(m,_mm_and_si128(_mm_cmpgt_epi8(v,d0),_mm_cmpgt_epi8(d9,v)));
+    m=_mm_or_si128(m,_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,dot),_mm_cmpeq_epi8(v,dash)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v,us),_mm_cmpeq_epi8(v,colon))));
+    mask=(unsigned int)(_mm_movemask_epi8(m) | _mm_movemask_epi8(v));
+    if (mask!=0xFFFF) {
+      return(i+__builtin_ctz(~mask));
+    }
+    i+=16;
+  }
+#endif
+  while (i<n && utf8NameByte[s[i]]) {
+    i++;
+  }
+  return(i);
+}
+
+
+/* Returns true if buf[pos] is within an entity reference, or just after
+ * one so that its end depends on buf[pos]: there is an '&' before pos
+ * followed only by an optional '#' and bytes that may be part of a Name.
+ */
+static int inEntity(const unsigned char* buf, size_t pos) {
+  while (pos>0 && utf8NameByte[buf[pos-1]]) {
+    pos--;
+  }
+  if (pos>0 && buf[pos-1]=='#') {
+    pos--;
+  }
+  return(pos>0 && buf[pos-1]=='&');
+}
+
+
+/* Make byte[] at least need long, the new part zeroed. Returns 0 if out
+ * of memory. */
+static int growBytes(utf8cond* c, size_t need) {
+  int* b;
+  size_t n=(c->maxByte>0 ? c->maxByte : BYTE_SIZE);
+
+  if (need<=c->maxByte) {
+    return(1);
+  }
+  while (n<need) { n*=2; }
+  if ((b=(int*)realloc(c->byte,n*sizeof(int)))==NULL) {
+    return(0);
+  }
+  memset(b+c->maxByte,0,(n-c->maxByte)*sizeof(int));
+  c->byte=b;
+  c->maxByte=n;
+  return(1);
+}
+
+/* Make pend[] at least need long. Returns 0 if out of memory. */
+static int growPend(utf8cond* c, size_t need) {
+  unsigned char* p;
+  size_t n=(c->maxPend>0 ? c->maxPend : 2*MAX_BYTES);
+
+  if (need<=c->maxPend) {
+    return(1);
+  }
+  while (n<need) { n*=2; }
+  if ((p=(unsigned char*)realloc(c->pend,n))==NULL) {
+    return(0);
+  }
+  c->pend=p;
+  c->maxPend=n;
+  return(1);
+}
+
+/* Add a part to the error record for the current char */
+static void addPart(utf8cond* c, int kind, unsigned long long arg, int arg2) {
+  if (c->err.nparts<UTF8COND_MAX_PARTS) {
+    c->err.part[c->err.nparts].kind=kind;
+    c->err.part[c->err.nparts].arg=arg;
+    c->err.part[c->err.nparts].arg2=arg2;
+    c->err.nparts++;
+  }
+}
+
+
+/* Short names for the kinds of error, for machine readable output */
+const char* utf8condErrorKind(int kind) {
+  static const char* names[UTF8COND_NUM_KINDS] = {
+    "illegal-byte", "not-continuation", "premature-eof", "overlong",
+    "illegal-code", "entity-eof", "entity-control", "entity-bad-char",
+    "bad-ncr", "bad-entity", "entity-too-long", "not-xml1.0", "not-xml1.1",
+    "bad-code", "restricted", "substituted", "substituted-bytes", "repaired" };
+  return(kind>=0 && kind<UTF8COND_NUM_KINDS ? names[kind] : "unknown");
+}
+
+
+/* Copy the bytes[] of an entity reference of length n to ref for a
+ * message, with any byte from 0x80 as '?' so messages stay ASCII (the
+ * bytes themselves are in the error record). Longer references are cut
+ * short, the caller adds ... */
+static const char* entityText(char* ref, const unsigned char* bytes, unsigned long long n) {
+  int j, len=(int)(n<UTF8COND_MAX_BYTES ? n : UTF8COND_MAX_BYTES);
+
+  for (j=0; j<len; j++) {
+    ref[j]=(char)(bytes[j]<0x80 ? bytes[j] : '?');
+  }
+  ref[len]='\0';
+  return(ref);
+}
+
+
+/* Write the message for error e into buf, as much as fits in size
+ * (which must be at least 1), and return the length of the whole
+ * message. Messages are only built when they are needed, so the cost
+ * of errors that are not reported is small.
+ */
+size_t utf8condErrorText(const utf8condError* e, char* buf, size_t size) {
+  char tmp[200];
+  char ref[UTF8COND_MAX_BYTES+1];
+  size_t n=0, m;
+  unsigned long long a;
+  int p, k;
+
+  buf[0]='\0';
+  for (p=0; p<e->nparts; p++) {
+    a=e->part[p].arg;
+    m=0;
+    if (p>0) {
+      m=snprintf(tmp,sizeof(tmp),", ");
+    }
+    switch (e->part[p].kind) {
+      case UTF8COND_ILLEGAL_BYTE:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"illegal byte: 0x%02X",(unsigned int)a);
+        break;
+      case UTF8COND_NOT_CONTINUATION:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"byte %d isn't continuation:",(int)a);
+        for (k=0; k<(int)a && k<UTF8COND_MAX_BYTES; k++) {
+          m+=snprintf(tmp+m,sizeof(tmp)-m," 0x%02X",e->bytes[k]);
+        }
+        m+=snprintf(tmp+m,sizeof(tmp)-m,", restart at 0x%02X",e->bytes[a-1]);
+        break;
+      case UTF8COND_PREMATURE_EOF:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"premature EOF at byte %llu, should be byte %d of code",a,e->part[p].arg2);
+        break;
+      case UTF8COND_OVERLONG:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"illegal overlong encoding of 0x%04X",(unsigned int)a);
+        break;
+      case UTF8COND_ILLEGAL_CODE:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"illegal UTF-8 code: 0x%04X",(unsigned int)a);
+        break;
+      case UTF8COND_ENTITY_EOF:
+      case UTF8COND_ENTITY_CONTROL:
+      case UTF8COND_BAD_NCR:
+      case UTF8COND_BAD_ENTITY:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"%s%s%s",
+                    (e->part[p].kind==UTF8COND_ENTITY_EOF ? "EOF in entity reference, terminated to read " :
+                     e->part[p].kind==UTF8COND_ENTITY_CONTROL ? "character<32 in entity reference, terminated to read " :
+                     e->part[p].kind==UTF8COND_BAD_NCR ? "bad numeric character reference: " :
+                     "illegal XML  entity reference: "),
+                    entityText(ref,e->bytes,a+1),(a+1>UTF8COND_MAX_BYTES ? "..." : ""));
+        break;
+      case UTF8COND_ENTITY_BAD_CHAR:
+        k=e->part[p].arg2+1;
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"bad character in entity reference, got 0x%02X, terminated to read %s%s",
+                    (unsigned int)a,entityText(ref,e->bytes,k),(k>UTF8COND_MAX_BYTES ? "..." : ""));
+        break;
+      case UTF8COND_ENTITY_TOO_LONG:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"entity reference too long (out of memory), cut short");
+        break;
+      case UTF8COND_NOT_XML1_0:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"code not allowed in XML1.0: 0x%04X",(unsigned int)a);
+        break;
+      case UTF8COND_NOT_XML1_1:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"code not allowed in XML1.1: 0x%04X",(unsigned int)a);
+        break;
+      case UTF8COND_BAD_CODE:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"bad code: 0x%04X",(unsigned int)a);
+        break;
+      case UTF8COND_RESTRICTED:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"code restricted in XML1.1: 0x%04X, substituted NCR: '%.*s'",
+                    (unsigned int)a,e->nrepl,(const char*)e->repl);
+        break;
+      case UTF8COND_SUBSTITUTED:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"substituted 0x%02X",(unsigned int)a);
+        break;
+      case UTF8COND_SUBSTITUTED_BYTES:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"substituted ");
+        for (k=0; k<(int)a && k<e->nrepl; k++) {
+          m+=snprintf(tmp+m,sizeof(tmp)-m," 0x%02X",e->repl[k]);
+        }
+        break;
+      case UTF8COND_REPAIRED:
+        m+=snprintf(tmp+m,sizeof(tmp)-m,"transcoded from %s to",
+                    (e->part[p].arg2==UTF8COND_REPAIR_CP1252 ? "Windows-1252" : "Latin-1"));
+        for (k=0; k<(int)a && k<e->nrepl; k++) {
+          m+=snprintf(tmp+m,sizeof(tmp)-m," 0x%02X",e->repl[k]);
+        }
+        break;
+    }
+    if (m>=sizeof(tmp)) {
+      m=sizeof(tmp)-1;
+    }
+    if (n<size-1) {
+      memcpy(buf+n,tmp,(m<size-1-n ? m : size-1-n));
+      buf[(n+m<size-1 ? n+m : size-1)]='\0';
+    }
+    n+=m;
+  }
+  return(n);
+}
+
+/***end***/
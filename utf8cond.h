@@ -0,0 +1,208 @@
+/* libutf8conditioner - UTF-8 checker and conditioner library
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * Usage:
+ *
+ *   utf8condOptions opt;
+ *   utf8cond* c;
+ *
+ *   utf8condDefaults(&opt);
+ *   opt.checkXML1_0Chars=1;                      (as -x)
+ *   c=utf8condNew(&opt, writeFn, errorFn, ctx);
+ *   while (...more input...) {
+ *     utf8condFeed(c, buf, len);                 (any chunk size)
+ *   }
+ *   numErrors=utf8condFinish(c);
+ *   utf8condFree(c);
+ *
+ * Conditioned output is passed to writeFn in pieces as it is produced
+ * and each error to errorFn (either may be NULL). Chunks may end part
+ * way through a UTF-8 character or entity reference, the bytes are held
+ * until the next utf8condFeed() or utf8condFinish(). A utf8cond holds
+ * no global state so separate objects may be used from separate threads.
+ */
+
+#ifndef UTF8COND_H
+#define UTF8COND_H
+
+#include <stddef.h>
+
+/* Set of code points, such as the bad codes given with -b. Membership
+ * is a two level bitmap lookup so sets of any size are fast. */
+typedef struct utf8condCodeSet utf8condCodeSet;
+
+utf8condCodeSet* utf8condCodeSetNew(void);
+int utf8condCodeSetAdd(utf8condCodeSet* set, unsigned int first, unsigned int last);
+int utf8condCodeSetHas(const utf8condCodeSet* set, unsigned int code);
+void utf8condCodeSetFree(utf8condCodeSet* set);
+
+/* Set of entity names, a hash table. Names are bytes of UTF-8, not NUL
+ * terminated. */
+typedef struct utf8condNameSet utf8condNameSet;
+
+utf8condNameSet* utf8condNameSetNew(void);
+int utf8condNameSetAdd(utf8condNameSet* set, const unsigned char* name, size_t len);
+int utf8condNameSetHas(const utf8condNameSet* set, const unsigned char* name, size_t len);
+void utf8condNameSetFree(utf8condNameSet* set);
+int utf8condValidName(const unsigned char* name, size_t len);
+
+typedef struct utf8condOptions {
+  int maxErrors;                  /* max number of errors to report, 0 for unlimited */
+  int checkOnly;                  /* check only, no output */
+  int substituteChar;             /* substitute for bad characters */
+  int checkXML1_0Chars;           /* XML1.0 checks */
+  int checkXML1_1Chars;           /* XML1.1 checks for Char */
+  int checkXML1_1Restricted;      /* XML1.1 checks for RestrictedChar */
+  int checkOverlong;              /* check for overlong character encodings */
+  int badMultiByteToMultiChar;    /* replace bad multi-byte with multiple chars */
+  int repair;                     /* UTF8COND_REPAIR_*, charset to transcode bad
+                                     UTF-8 from instead of substituting */
+  utf8condCodeSet* badCodes;      /* bad codes, NULL if none */
+  utf8condNameSet* entities;      /* entities that may be referred to, NULL
+                                     for just the five XML predefines */
+} utf8condOptions;
+
+/* Charsets for opt.repair, bytes of bad UTF-8 sequences are taken as
+ * characters of the charset */
+enum {
+  UTF8COND_REPAIR_NONE,
+  UTF8COND_REPAIR_LATIN1,         /* ISO-8859-1 */
+  UTF8COND_REPAIR_CP1252          /* Windows-1252, undefined bytes as C1 controls */
+};
+
+typedef struct utf8cond utf8cond;
+
+/* Called with each piece of conditioned output. Long unchanged runs
+ * point into the buffer passed to utf8condFeed(), other pieces (never
+ * longer than UTF8COND_MAX_BYTES) to storage that is only valid for the
+ * duration of the call */
+typedef void (*utf8condWriteFn)(void* ctx, const unsigned char* s, size_t n);
+
+/*
+ * Each error is reported as a record of what was found rather than as
+ * text, utf8condErrorText() gives the message utf8conditioner prints.
+ * A record has one or more parts (the message has these separated by
+ * commas), the first is the main problem. Parts that show bytes take
+ * them from bytes[], as read for the character or entity reference, or
+ * from repl[], what was written in their place.
+ */
+enum {
+  UTF8COND_ILLEGAL_BYTE,          /* arg is the byte */
+  UTF8COND_NOT_CONTINUATION,      /* arg is the number of the byte that isn't */
+  UTF8COND_PREMATURE_EOF,         /* arg is the byte count, arg2 the byte expected */
+  UTF8COND_OVERLONG,              /* arg is the code */
+  UTF8COND_ILLEGAL_CODE,          /* arg is the code */
+  UTF8COND_ENTITY_EOF,            /* arg is the length of the entity reference read */
+  UTF8COND_ENTITY_CONTROL,        /* arg is the length of the entity reference read */
+  UTF8COND_ENTITY_BAD_CHAR,       /* arg is the byte that ended it, arg2 the length read */
+  UTF8COND_BAD_NCR,               /* arg is the length of the entity reference */
+  UTF8COND_BAD_ENTITY,            /* arg is the length of the entity reference */
+  UTF8COND_ENTITY_TOO_LONG,       /* only if out of memory, there is no limit */
+  UTF8COND_NOT_XML1_0,            /* arg is the code */
+  UTF8COND_NOT_XML1_1,            /* arg is the code */
+  UTF8COND_BAD_CODE,              /* arg is the code */
+  UTF8COND_RESTRICTED,            /* arg is the code, replaced with an NCR */
+  UTF8COND_SUBSTITUTED,           /* arg is the substitute */
+  UTF8COND_SUBSTITUTED_BYTES,     /* arg is the number of bytes in repl[] (-m) */
+  UTF8COND_REPAIRED,              /* arg is the number of bytes in repl[], arg2
+                                     the charset (opt.repair) */
+  UTF8COND_NUM_KINDS
+};
+
+#define UTF8COND_MAX_PARTS 16
+#define UTF8COND_MAX_BYTES 32        /* longer entity references are cut short */
+
+typedef struct utf8condError {
+  unsigned long long line;        /* position of the end of the bad code */
+  unsigned long long chr;
+  unsigned long long byte;
+  int isError;                    /* 0 for restricted chars, which aren't counted */
+  long int code;                  /* code point decoded, -1 if none */
+  int nparts;
+  struct {
+    int kind;
+    unsigned long long arg;
+    int arg2;
+  } part[UTF8COND_MAX_PARTS];
+  unsigned char bytes[UTF8COND_MAX_BYTES];
+  int nbytes;                     /* number of bytes of input used, may be
+                                     more than UTF8COND_MAX_BYTES */
+  unsigned char repl[UTF8COND_MAX_BYTES];
+  int nrepl;
+} utf8condError;
+
+/* Called for each error reported */
+typedef void (*utf8condErrorFn)(void* ctx, const utf8condError* e);
+
+size_t utf8condErrorText(const utf8condError* e, char* buf, size_t size);
+const char* utf8condErrorKind(int kind);
+
+/*
+ * Counts collected after utf8condCollectStats(). Characters passed over
+ * by the fast paths (runs of ASCII, or valid runs with -c) are only
+ * counted in fastBytes, the rest are decoded one at a time on the slow
+ * path. Collecting stats costs nothing until it is turned on.
+ */
+typedef struct utf8condStats {
+  unsigned long long bytes;
+  unsigned long long chars;
+  unsigned long long lines;       /* number of newlines */
+  unsigned long long errors[UTF8COND_NUM_KINDS]; /* by kind of the first
+                                     part, reported or not */
+  unsigned long long charBytes[7];/* chars decoded on the slow path by
+                                     number of bytes read, 1 to 6 */
+  unsigned long long entities;    /* entity references */
+  unsigned long long fastBytes;
+  unsigned long long slowBytes;
+  double fastSeconds;             /* time in each path */
+  double slowSeconds;
+} utf8condStats;
+
+void utf8condDefaults(utf8condOptions* opt);
+int utf8condAddBadChar(utf8condOptions* opt, unsigned int code);
+int utf8condAddBadRange(utf8condOptions* opt, unsigned int first, unsigned int last);
+int utf8condAddEntity(utf8condOptions* opt, const char* name, size_t len);
+void utf8condFreeOptions(utf8condOptions* opt);
+int utf8condSetXML(utf8condOptions* opt, const char* type);
+int utf8condSetRepair(utf8condOptions* opt, const char* charset);
+unsigned long long utf8condOptionsHash(const utf8condOptions* opt);
+
+utf8cond* utf8condNew(const utf8condOptions* opt, utf8condWriteFn write,
+                      utf8condErrorFn error, void* ctx);
+void utf8condFeed(utf8cond* c, const unsigned char* buf, size_t len);
+int utf8condFinish(utf8cond* c);
+void utf8condReset(utf8cond* c);
+int utf8condNumErrors(const utf8cond* c);
+unsigned long int utf8condNumChanged(const utf8cond* c);
+void utf8condCollectStats(utf8cond* c);
+void utf8condGetStats(const utf8cond* c, utf8condStats* stats);
+void utf8condSetPosition(utf8cond* c, unsigned long long line,
+                         unsigned long long chr, unsigned long long byte);
+void utf8condPosition(const utf8cond* c, unsigned long long* line,
+                      unsigned long long* chr, unsigned long long* byte);
+
+/* Where conditioning has got to, so that input which is appended to can
+ * be carried on with later (perhaps by another process) with the same
+ * results as conditioning all of it in one go */
+typedef struct utf8condState {
+  unsigned long long line, chr, byte;
+  int numErrors;
+  unsigned long int numChanged;
+  const unsigned char* held;      /* input not yet conditioned */
+  size_t nheld;
+} utf8condState;
+
+void utf8condGetState(const utf8cond* c, utf8condState* state);
+int utf8condSetState(utf8cond* c, const utf8condState* state);
+
+/* Input may be split at the points returned by utf8condSplitPoint() and
+ * the parts conditioned separately, for example in parallel, with the
+ * same results as for the whole */
+size_t utf8condSplitPoint(const utf8condOptions* opt, const unsigned char* buf,
+                          size_t len, size_t pos);
+void utf8condFree(utf8cond* c);
+
+#endif
@@ -13,19 +13,8 @@
  * be able to parse it (albeit with some corruption introduced by
  * substitution of dummy characters in place of illegal codes).
  *
- * I assume that the most likely cause of errors is inclusion of non-UTF-8
- * bytes from various 8-bit character sets. Thus, any attempt to read a
- * sequence of continuation bytes that finds an invalid byte will result
- * in the termination of the attempt to read the multi-byte character. Each
- * valid single byte will be written out, invalid single bytes will be 
- * replaced with a dummy character. The hope is that this will avoid an 
- * error having run-on effects which might interfere with XML markup.
- * (Option -m changes this behaviour to replace an invalid multi-byte
- * with a single dummy character.)
- *
- * Bugs:
- * - no protection against overflow of byte, character and line counters
- *   (unsigned long int). Will result in incorrect output messages.
+ * This file is the command line program, the conditioning itself is
+ * done by libutf8conditioner (utf8cond.c, interface in utf8cond.h).
  *
  * [CVS: $Id: utf8conditioner.c,v 1.16 2015/01/07 15:02:10 sw272 Exp $]
  */
@@ -36,79 +25,314 @@
 
 #define GNU_GPL_NOTICE2 "This program is distributed in the hope that it will be useful,\nbut WITHOUT ANY WARRANTY; without even the implied warranty of\nMERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the\nGNU General Public License for more details.\n\nYou should have received a copy of the GNU General Public License\nalong with this program (in the file COPYING); if not, visit\nhttp://www.gnu.org/licenses/gpl.html or write to the Free Software\nFoundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA\n"
 
+#define _GNU_SOURCE /* for copy_file_range() */
 #include <stdio.h>
 //extern int snprintf(char *str, size_t size, const char *format, ...);
 #include <string.h>
 #include <stdlib.h> /* for strtoul() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h> /* for mmap() */
+#include <sys/uio.h> /* for writev() */
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h> /* for --serve */
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h> /* for IOV_MAX, PATH_MAX */
+#include <stddef.h> /* for offsetof() */
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h> /* for clock_gettime() */
+#include <zlib.h>
 #include "getopt.h" /* for getopt(), could use unistd on Unix */ 
+#include "utf8cond.h"
+#include "workqueue.h"
+
+#define IN_BUF_SIZE 65536         /* size of input buffer */
+#define MAX_THREADS 256           /* limit for -j */
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (4*1024*1024)  /* size of parts for -j */
+#endif
+#define OUT_IOV 512               /* number of output spans gathered before writev() */
+#define OUT_POOL 8192             /* space for copies of short output pieces */
+#define OUT_SHORT 64              /* pieces shorter than this are copied */
+#ifndef IOV_MAX
+#define IOV_MAX 1024              /* limit on spans per writev() call */
+#endif
+#define ERR_BUF_SIZE 65536        /* buffer for error messages */
+#define Z_BUF_SIZE 65536          /* buffer for compressed output, -z */
+#define PASS_SIZE (4*1024*1024)   /* input held back before copying */
+#define PIPE_SLOTS 8              /* input buffers in the -j pipeline */
+#define TOKEN_MAX 4096            /* longest token or attributes, --extract-token */
+
+/* regular files a and b (struct stat*) are the same file */
+#define SAME_FILE(a,b) (S_ISREG((a)->st_mode) && (a)->st_dev==(b)->st_dev && (a)->st_ino==(b)->st_ino)
+
+/* formats for error messages, --errors-format */
+enum { ERRORS_TEXT, ERRORS_JSONL, ERRORS_CSV };
+
+/* formats for --stats */
+enum { STATS_NONE, STATS_TEXT, STATS_JSON };
+
+/* framing for --records */
+enum { RECORDS_NONE, RECORDS_NUL, RECORDS_LENGTH };
+
+/* Long options, which getopt() doesn't do, see longOptions() */
+typedef struct longOpts {
+  int errorsFormat;               /* --errors-format */
+  const char* errorsOut;          /* --errors-out file, stderr if NULL */
+  int stats;                      /* --stats */
+  const char* entities;           /* --entities file */
+  const char* cache;              /* --cache dir */
+  const char* checkpoint;         /* --checkpoint file */
+  const char* serve;              /* --serve socket */
+  const char* repair;             /* --repair charset */
+  const char* extractToken;       /* --extract-token file */
+  int records;                    /* --records */
+} longOpts;
+
+/*
+ * Output is gathered as a list of spans and written with writev().
+ * Long spans point straight into the input (the mmap()ed file or inBuf)
+ * and are not copied, short pieces such as substituted characters are
+ * copied into pool. Anything pointing into inBuf must be written before
+ * inBuf is reused, see flushOutput(). After a write error nothing more
+ * is written and error is set to errno. With -z the spans are deflated
+ * into a gzip stream instead, finishOutput() ends it.
+ */
+typedef struct outputSpans {
+  int fd;
+  int error;
+  struct iovec iov[OUT_IOV];
+  int niov;
+  unsigned char pool[OUT_POOL];
+  size_t npool;
+  int compress;                   /* -z */
+  int zstarted;                   /* z has been set up for this output */
+  z_stream z;
+  unsigned char zbuf[Z_BUF_SIZE];
+  const unsigned char* pass;      /* mapped input, see startPass() */
+  size_t passed;                  /* bytes of it written */
+  size_t npass;                   /* bytes after that output is the same as */
+  size_t maxPass;
+  int passFd;                     /* file pass is mapped from */
+} outputSpans;
+
+/*
+ * Verdicts for files conditioned before, see openCache(). The index file
+ * is only appended to, with a record in one write(), so it can be shared
+ * by concurrent runs. Records are looked up in a table loaded at start,
+ * those added during the run are only written to the file.
+ */
+typedef struct cacheRecord {
+  unsigned long long dev, ino, size;
+  long long mtime, ctime;         /* in ns */
+  unsigned long long options;     /* utf8condOptionsHash() */
+  int numErrors;
+  int changed;                    /* output isn't the same as input */
+  unsigned long long check;       /* hash of the above, 0 for an empty slot */
+} cacheRecord;
+
+/*
+ * --extract-token looks for <resumptionToken ...>token</resumptionToken>
+ * in the output as it is written, so a harvester can go on to the next
+ * request without parsing the document. memchr() skips to each '<' and
+ * the tag is then matched a byte at a time, across output pieces if need
+ * be. Each token found is written to fp as a line with the input name,
+ * the token and the attributes separated by tabs. Tokens or attributes
+ * longer than TOKEN_MAX are dropped.
+ */
+enum { TOKEN_OUT, TOKEN_NAME, TOKEN_ATTR, TOKEN_TEXT, TOKEN_END };
 
-#define MAX_BAD_CHAR 100
-#define MAX_BYTES 10
+typedef struct tokenScan {
+  FILE* fp;
+  int state;                      /* TOKEN_* */
+  size_t matched;                 /* bytes of the name or end tag matched */
+  int quote;                      /* quote an attribute value is in, or 0 */
+  char attr[TOKEN_MAX];
+  size_t nattr;
+  char token[TOKEN_MAX];
+  size_t ntoken;
+} tokenScan;
 
-int validUnicodeChar(unsigned int ch);
-int validXML1_0Char(unsigned int ch);
-int validXML1_1Char(unsigned int ch);
-int validUTF8Char(unsigned int ch);
-unsigned int parseNumericCharacterReference(int b[]);
-int validXMLEntity(int b[]);
-char* byteToStr(char* byteStr, int* byte, int n);
-void addMessage(char* msg);
+typedef struct verdictCache {
+  cacheRecord* table;
+  size_t size;                    /* a power of 2 */
+  int fd;                         /* index, opened to append */
+  unsigned long long options;
+} verdictCache;
 
-char error[200];                  /* global place to build error string */
+/*
+ * Everything needed to condition one file, passed to the callbacks.
+ * name is NULL unless text messages need the file name, input is the
+ * name used in JSON Lines and CSV messages. Messages go to err, stderr
+ * or the --errors-out file except in batch mode. If the file can't be
+ * read or written conditionNamed() describes the problem in failure.
+ */
+typedef struct condContext {
+  outputSpans* out;
+  FILE* err;
+  int errorsFormat;
+  utf8condStats* stats;           /* totals to add stats to, NULL if none */
+  const char* name;
+  const char* input;
+  const utf8condOptions* opt;
+  int quiet;
+  int threads;                    /* number of threads for -j */
+  unsigned char* inBuf;           /* IN_BUF_SIZE bytes for input that isn't mapped */
+  verdictCache* cache;            /* --cache, NULL if none */
+  struct inPlace* inPlace;        /* -i, NULL if not */
+  struct serveBuffer* reply;      /* --serve output */
+  struct part* stage;             /* output goes here when pipelined */
+  tokenScan* token;               /* --extract-token, NULL if not */
+  unsigned long long reported;    /* --checkpoint, errors up to this byte were reported */
+  unsigned long int numChanged;   /* set by conditionFile() */
+  char failure[1024];
+} condContext;
+
+/*
+ * Batch mode (-d, -S or -T) conditions many files on a pool of -j
+ * threads. Each file is written to a file of the same name in outDir
+ * and/or with outSuffix added. Messages for each file are collected
+ * and written together, and a status line for each file is written to
+ * stdout, all in the order the files were given.
+ */
+typedef struct batchFile {
+  int numErrors;                  /* -1 if failed */
+  char* msgs;                     /* messages for err */
+  size_t nmsgs;
+  char* failure;                  /* why it failed, for stderr */
+  utf8condStats stats;
+} batchFile;
+
+typedef struct batchJob {
+  char** names;
+  int nfiles;
+  batchFile* files;
+  const char* outDir;
+  const char* outSuffix;
+  char** outFiles;                /* output for each file, NULL with -c */
+  const utf8condOptions* opt;
+  int quiet;
+  FILE* err;
+  int errorsFormat;
+  utf8condStats* stats;           /* totals, NULL if none */
+  outputSpans* out;               /* per thread */
+  unsigned char* inBuf;           /* per thread */
+  int compress;                   /* -z */
+  verdictCache* cache;
+  int numFailed;
+} batchJob;
+
+int conditionNamed(const char* name, const char* outFile, condContext* ctx);
+int conditionCheckpointed(const char* name, const char* outFile, const char* cpFile, condContext* ctx);
+int conditionInPlace(const char* name, condContext* ctx);
+void serve(const char* path, const utf8condOptions* opt, int quiet, int errorsFormat, int threads);
+int conditionRecords(int format, const utf8condOptions* opt, int quiet, int errorsFormat,
+                     FILE* err, utf8condStats* stats, int threads);
+int conditionFile(utf8cond* cond, int fd, condContext* ctx);
+int compressedInput(const unsigned char* s, size_t n);
+verdictCache* openCache(const char* dir, const utf8condOptions* opt);
+int cacheLookup(const verdictCache* c, const struct stat* st, int* numErrors, int* changed);
+int cacheStore(verdictCache* c, const struct stat* st, int numErrors, int changed);
+void closeCache(verdictCache* c);
+int conditionCompressed(utf8cond* cond, int fd, const unsigned char* in, size_t n, condContext* ctx);
+int conditionParallel(const unsigned char* map, size_t len, condContext* ctx);
+int conditionPipelined(utf8cond* cond, int fd, const unsigned char* in, size_t n, condContext* ctx);
+void conditionBatch(batchJob* b, int threads);
+char** readFileList(const char* listFile, int sep, char** names, int* nfiles);
+int addBadCodes(utf8condOptions* opt, const char* s, const char* end);
+void readBadCodes(utf8condOptions* opt, const char* file);
+void readEntities(utf8condOptions* opt, const char* file);
+void writeOutput(void* ctx, const unsigned char* s, size_t n);
+void scanToken(tokenScan* t, const char* input, const unsigned char* s, size_t n);
+void partWrite(void* ctx, const unsigned char* s, size_t n);
+void writeInPlace(void* ctx, const unsigned char* s, size_t n);
+void writeServe(void* ctx, const unsigned char* s, size_t n);
+void* growArray(void* a, size_t* max, size_t need, size_t size);
+void flushOutput(outputSpans* out);
+void startPass(outputSpans* out, int fd, const unsigned char* map, size_t len);
+void endPass(outputSpans* out);
+void copyPass(outputSpans* out);
+void finishOutput(outputSpans* out);
+int longOptions(int argc, char* argv[], longOpts* lo);
+void addStats(utf8condStats* total, const utf8condStats* stats);
+void printStats(FILE* fp, int format, const utf8condStats* stats, double secs);
+void printError(void* ctx, const utf8condError* e);
+void printUnreported(condContext* c, int n);
+double now(void);
+void printErrorsHeader(FILE* err, int errorsFormat);
 
 
 int main (int argc, char* argv[]) {
-  int j,k;
-  int ch;
-  char buf[100];                  /* tmp used when building error string */ 
-  char byteStr[MAX_BYTES+1];      /* used to build string for entity ref error messages */
-
-  int byte[MAX_BYTES];            /* bytes of UTF-8 char (must be long enough to hold &#x10FFFF\0 */
-  int contBytes;                  /* number of continuation bytes (0-5) */
-  int entityRef;                  /* true if contBytes are an entity ref as opposed to a long UTF8 char */
-  unsigned long int bytenum=0;    /* count of bytes read */
-  unsigned long int charnum=0;    /* count of characters read */
-  unsigned long int linenum=1;    /* count of lines */
-  unsigned int unicode;           /* Unicode character represented by UTF-8 */
- 
-  int maxErrors=1000;             /* max number of error messages to print */
-  int numErrors=0;                /* count of errors */   
+  int j;
+  utf8condOptions opt;            /* conditioning options */
   int quiet=0;                    /* quiet option */
-  int checkOnly=0;                /* check only option */
-  int substituteChar = '?';       /* substitute for bad characters */
-  int checkXML1_0Chars=0;         /* XML1.0 checks option */
-  int checkXML1_1Chars=0;         /* XML1.1 checks option for Char */
-  int checkXML1_1Restricted=0;    /* XML1.1 checks option for RestrictedChar */
-  int checkOverlong=1;            /* Check for overlong character encodings */
-  int badMultiByteToMultiChar=0;  /* -m option */
-  int checkEntities=0;            /* check entities if any XML checks are on */
-
-  int badChar=0;                  /* variables for bad characters option */ 
-  unsigned int badChars[MAX_BAD_CHAR];
-  int highestCharInNBytes[6];
-
-  badChars[badChar] = 0;          /* terminator */
-
-  highestCharInNBytes[0]=0x7F;
-  highestCharInNBytes[1]=0x7FF;
-  highestCharInNBytes[2]=0xFFFF;
-  highestCharInNBytes[3]=0x1FFFFF;
-  highestCharInNBytes[4]=0x3FFFFFF;
-  highestCharInNBytes[5]=0x7FFFFFFF;
+  int threads=1;                  /* -j threads */
+  const char* outFile=NULL;       /* output file, stdout if NULL */
+  const char* listFile=NULL;      /* -T list of files */
+  int listSep='\n';               /* separator for names in listFile */
+  static outputSpans out;
+  static unsigned char inBuf[IN_BUF_SIZE];
+  condContext ctx;
+  batchJob batch;
+  int numFiles;
+  int compress=0;                 /* -z */
+  int inPlaceMode=0;              /* -i */
+  verdictCache* cache=NULL;       /* --cache */
+  static tokenScan token;         /* --extract-token */
+  longOpts lo;
+  FILE* err=stderr;
+  utf8condStats stats;
+  struct stat st, inSt;
+  double startTime=now();
+
+  utf8condDefaults(&opt);
+  memset(&batch,0,sizeof(batch));
+  memset(&ctx,0,sizeof(ctx));
 
   /*
-   * Read any options
+   * Read any options, long options first as getopt() doesn't do them
    */
-  while ((j=getopt(argc,argv,"hH?qce:b:s:xX:mlL"))!=EOF) {
+  memset(&lo,0,sizeof(lo));
+  lo.errorsFormat=ERRORS_TEXT;
+  argc=longOptions(argc,argv,&lo);
+  memset(&stats,0,sizeof(stats));
+  while ((j=getopt(argc,argv,"hH?qce:b:B:s:xX:mlo:izj:d:S:T:0L"))!=EOF) {
     switch (j) {
-      case 'h': 
+      case 'h':
       case 'H':
       case '?':
         /* string split to meet ISO C89 requirement of <=509 chars */
         fprintf(stderr, PROGRAM_NOTICE);
-        fprintf(stderr,"\nusage: %s [-q] [-c] [-e num] [[-b char]] [-x] [[-X type]] [-s char] [-h]\n\n"
-"Takes UTF-8 input from stdin, writes processed UTF-8 to stdout\n"
-"and errors/warnings to stderr.\n\n", argv[0]);
+        fprintf(stderr,"\nusage: %s [-q] [-c] [-e num] [[-b char]] [[-B file]] [-x] [[-X type]] [-s char] [-o file | -i] [-z] [-j num] [-h] [file ...]\n"
+"       %s [options] [-d dir] [-S suffix] [-T list [-0]] [file ...]\n\n"
+"Takes UTF-8 input from the files given or stdin, writes processed UTF-8\n"
+"to stdout and errors/warnings to stderr. Input compressed with gzip or\n"
+"zlib is decompressed.\n\n", argv[0], argv[0]);
+        fprintf(stderr,"  --errors-format=fmt  format of error messages: text (default),\n"
+"                       jsonl (a JSON object per line) or csv\n"
+"  --errors-out=file    write error messages to file instead of stderr\n"
+"  --entities=file      entity names that may be referred to, as well as\n"
+"                       the XML predefined ones, either a DTD (names from\n"
+"                       <!ENTITY declarations) or a list like -B\n"
+"  --stats[=fmt]        write counts and timings to stderr at the end,\n"
+"                       as text (default) or json\n"
+"  --cache=dir          keep verdicts for files in dir and skip files\n"
+"                       that haven't changed since (see README)\n"
+"  --checkpoint=file    for one input file that is appended to, with -o\n"
+"                       or -c, carry on from where the last run got to\n"
+"  --serve=socket       condition requests on a Unix socket with -j\n"
+"                       threads (see README)\n"
+"  --repair=charset     transcode bytes that aren't UTF-8 from charset,\n"
+"                       latin1 or cp1252, instead of substituting\n"
+"  --extract-token=file write the resumptionToken and its attributes\n"
+"                       to file as soon as it has been output\n"
+"  --records=framing    condition records on stdin separately with -j\n"
+"                       threads, nul or length framed (see README)\n\n");
         fprintf(stderr,"  -c   just check, no output of XML to stdout\n"
 "  -q   quiet, don't output messages to stderr\n"
 "  -x   XML check (same as '-X 1.0')\n"
@@ -122,448 +346,3172 @@ int main (int argc, char* argv[]) {
 "              reference substitutions for restricted codes\n"
 "              (restricted codes are [#x1-#x8] | [#xB-#xC] |\n"
 "              [#xE-#x1F] | [#x7F-#x84] | [#x86-#xBF])\n"
-"         1.1lax  as 1.1 but do nothing about restricted chars.\n"
-"  -b   add Unicode character code to list of bad codes\n"
-"       (specified as decimal, 0octal or  0xhex),\n"
+"         1.1lax  as 1.1 but do nothing about restricted chars.\n");
+        fprintf(stderr,"  -b   add Unicode character code or range (first-last) to list of\n"
+"       bad codes (specified as decimal, 0octal or  0xhex),\n"
 "       use multiple times at add multiple characters\n"
+"  -B   add bad codes and ranges listed in file, separated by spaces\n"
+"       or new lines, with # to end of line a comment\n"
 "  -e   maximum number of error messages to print\n"
 "       (default %d, 0 for unlimited)\n"
 "  -l   lax - don't check for overlong encodings\n"
 "  -m   replace invalid multi-byte sequences with multiple dummy characters\n"
-"  -s   change character substituted for bad codes (default '%c')\n\n"
-"  -L   display information about license\n  -h   this help\n\n", maxErrors, substituteChar);  
+"  -j   number of threads to condition each large file with, or\n"
+"       to condition files with in batch mode\n"
+"  -o   write output to file instead of stdout\n"
+"  -i   rewrite each file given in place, no output to stdout\n"
+"  -z   compress output with gzip\n"
+"  -s   change character substituted for bad codes (default '%c')\n\n", opt.maxErrors, opt.substituteChar);
+        fprintf(stderr,"Batch mode, each file is conditioned separately and a status line\n"
+"(ok, errors or failed, number of errors, file name) written to stdout:\n"
+"  -d   write output for each file to a file of the same name in dir\n"
+"  -S   write output for each file to its name with suffix added\n"
+"  -T   read names of files to condition from list ('-' for stdin),\n"
+"       one per line\n"
+"  -0   names in list are separated by NUL characters not newlines\n\n"
+"  -L   display information about license\n  -h   this help\n\n");
         exit(1);
       case 'q':
         quiet=1;
         break;
       case 'c':
-        checkOnly=1;
-        break; 
+        opt.checkOnly=1;
+        break;
       case 'b':
-        if (badChar>=(MAX_BAD_CHAR-1)) {
-          fprintf(stderr,"Too many bad codes specified (limit %d), aborting!\n", MAX_BAD_CHAR);
-          exit(1); 
-        } 
-        badChars[badChar++]=(int)strtoul(utf8_optarg,NULL,0);
-        badChars[badChar]=0;
+        if (!addBadCodes(&opt,utf8_optarg,utf8_optarg+strlen(utf8_optarg))) {
+          fprintf(stderr,"Bad value for -b flag: '%s', aborting!\n",utf8_optarg);
+          exit(1);
+        }
+        break;
+      case 'B':
+        readBadCodes(&opt,utf8_optarg);
         break;
       case 'e':
-        maxErrors=(int)strtoul(utf8_optarg,NULL,0);
+        opt.maxErrors=(int)strtoul(utf8_optarg,NULL,0);
         break;
       case 's':
-        substituteChar = utf8_optarg[0];
+        opt.substituteChar = utf8_optarg[0];
         break;
       case 'm':
-        badMultiByteToMultiChar=1;
+        opt.badMultiByteToMultiChar=1;
         break;
       case 'l':
-        checkOverlong=0;
+        opt.checkOverlong=0;
+        break;
+      case 'j':
+        if ((threads=(int)strtoul(utf8_optarg,NULL,0))<1 || threads>MAX_THREADS) {
+          fprintf(stderr,"Bad value for -j flag: '%s' (limit %d), aborting!\n",utf8_optarg,MAX_THREADS);
+          exit(1);
+        }
+        break;
+      case 'o':
+        outFile=utf8_optarg;
+        break;
+      case 'i':
+        inPlaceMode=1;
+        break;
+      case 'z':
+        compress=1;
+        break;
+      case 'd':
+        batch.outDir=utf8_optarg;
+        break;
+      case 'S':
+        batch.outSuffix=utf8_optarg;
+        break;
+      case 'T':
+        listFile=utf8_optarg;
+        break;
+      case '0':
+        listSep='\0';
         break;
       case 'x':
-        checkXML1_0Chars=1;
-        break; 
+        opt.checkXML1_0Chars=1;
+        break;
       case 'X':
-        if (strcmp(utf8_optarg,"1.0")==0) {
-          checkXML1_0Chars=1;
-        } else if (strcmp(utf8_optarg,"1.1")==0) { 
-          checkXML1_1Chars=1;
-          checkXML1_1Restricted=1;
-        } else if (strcmp(utf8_optarg,"1.1lax")==0) { 
-          checkXML1_1Chars=1;
-        } else {
+        if (!utf8condSetXML(&opt,utf8_optarg)) {
           fprintf(stderr,"Bad value for -X flag: '%s', aborting!\n",utf8_optarg);
           exit(1);
         }
-        break; 
+        break;
       case 'L':
         fprintf(stderr,GNU_GPL_NOTICE1);
         fprintf(stderr,GNU_GPL_NOTICE2);
         exit(1);
     }
   }
-  checkEntities=(checkXML1_0Chars || checkXML1_1Chars);
+
+  if (lo.repair!=NULL && !utf8condSetRepair(&opt,lo.repair)) {
+    fprintf(stderr,"Bad value for --repair: '%s', aborting!\n",lo.repair);
+    exit(1);
+  }
+  if (lo.entities!=NULL) {
+    readEntities(&opt,lo.entities);
+  }
+  if (lo.extractToken!=NULL) {
+    if (opt.checkOnly || inPlaceMode || lo.serve!=NULL || lo.checkpoint!=NULL || lo.records!=RECORDS_NONE ||
+        batch.outDir!=NULL || batch.outSuffix!=NULL || listFile!=NULL) {
+      fprintf(stderr,"--extract-token looks at the output so can't be used with -c, -i, batch mode, --serve, --records or --checkpoint, aborting!\n");
+      exit(1);
+    }
+    if ((token.fp=fopen(lo.extractToken,"w"))==NULL) {
+      fprintf(stderr,"Can't open token file '%s': %s, aborting!\n",lo.extractToken,strerror(errno));
+      exit(1);
+    }
+  }
 
   /*
-   * Barf if anything on command line left unread (probably an attempt to 
-   * specify a file name instead of using stdin)
+   * Error messages are buffered, there may be very many of them
    */
-  if (argc>utf8_optind) {
-    fprintf(stderr,"Unknown parameters specified on command line (-h for help), aborting!\n");
-    exit(1); 
+  if (lo.errorsOut!=NULL && !quiet && (err=fopen(lo.errorsOut,"w"))==NULL) {
+    fprintf(stderr,"Can't open errors file '%s': %s, aborting!\n",lo.errorsOut,strerror(errno));
+    exit(1);
+  }
+  setvbuf(err,NULL,_IOFBF,ERR_BUF_SIZE);
+  if (!quiet) {
+    printErrorsHeader(err,lo.errorsFormat);
+  }
+  if (lo.cache!=NULL) {
+    cache=openCache(lo.cache,&opt);
   }
 
   /*
-   * Go through input code (character) by code and check for correct use 
-   * of UTF-8 continuation bytes, check for unicode character validity
+   * Daemon, runs until killed
    */
-  while ((ch=getc(stdin))!=EOF) {
-    bytenum++; charnum++;
-    if (ch=='\n') { linenum++; }
-    error[0]='\0'; /* clear error string */
-    unicode=ch;
-    if ((ch&0x80)==0) {
-      /* one byte char    0000 0000-0000 007F   0xxxxxxx */
-      contBytes=0;
-    } else if ((ch&0xE0)==0xC0) {
-      /* 0000 0080-0000 07FF   110xxxxx 10xxxxxx */
-      contBytes=1;
-      unicode=(ch&0x1F);
-    } else if ((ch&0xF0)==0xE0) {
-      /* 0000 0800-0000 FFFF   1110xxxx 10xxxxxx 10xxxxxx */
-      contBytes=2;
-      unicode=(ch&0x0F);
-    } else if ((ch&0xF8)==0xF0) {
-      /* 0001 0000-001F FFFF   11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
-      contBytes=3;
-      unicode=(ch&0x07);
-    } else if ((ch&0xFC)==0xF8) {
-      /* 0020 0000-03FF FFFF   111110xx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx */
-      contBytes=4;
-      unicode=(ch&0x03);
-    } else if ((ch&0xFE)==0xFC) {
-      /* 0400 0000-7FFF FFFF   1111110x 10xxxxxx ... 10xxxxxx */
-      contBytes=5;
-      unicode=(ch&0x01);
-    } else {
-      snprintf(error,sizeof(error),"illegal byte: 0x%02X", ch);
-      contBytes=0;
-    }
-    byte[0]=ch;
-    
-    for (j=1; j<=contBytes; j++) {
-      if ((ch=getc(stdin))!=EOF) {
-        bytenum++;
-	byte[j]=ch;
-        if ((ch&0xC0)!=0x80) {
-          /* doesn't match 10xxxxxx */
-	  snprintf(buf,sizeof(buf),"byte %d isn't continuation:",(j+1));
-          addMessage(buf);
-          for (k=0; k<=j; k++) {
-            snprintf(buf,sizeof(buf)," 0x%02X", byte[k]);
-            addMessage(buf);
-          }
-	  snprintf(buf,sizeof(buf),"restart at 0x%02X",ch);
-          addMessage(buf);
-	  ungetc(ch,stdin);
-	  bytenum--;
-	  break;
-        }
-        unicode = (unicode << 6) + (ch&0x3F);
-      } else {
-        snprintf(buf,sizeof(buf),"premature EOF at byte %ld, should be byte %d of code", bytenum, j);
-        addMessage(buf);
-        break;
-      }
+  if (lo.serve!=NULL) {
+    if (argc>utf8_optind || outFile!=NULL || inPlaceMode || compress || lo.checkpoint!=NULL ||
+        batch.outDir!=NULL || batch.outSuffix!=NULL || listFile!=NULL) {
+      fprintf(stderr,"--serve takes no files and can't be used with -o, -i, -z, batch mode or --checkpoint, aborting!\n");
+      exit(1);
     }
+    serve(lo.serve,&opt,quiet,lo.errorsFormat,threads);
+  }
 
-    /* check for overlong encodings if no error already */
-    if ((error[0]=='\0') && checkOverlong && contBytes>0 
-                         && (unicode<=highestCharInNBytes[contBytes-1])) {
-      snprintf(buf,sizeof(buf),"illegal overlong encoding of 0x%04X",unicode);
-      addMessage(buf);
-    }
- 
-    /* Attempt to read numeric character reference or entity reference if we 
-     * have an ampersand (&) start character, e.g. &#123; for decimal, 
-     * &#xABC; for hex 
-     *
-     * http://www.w3.org/TR/2000/WD-xml-2e-20000814#dt-charref
-     *
-     * [66] CharRef ::= '&#' [0-9]+ ';' | '&#x' [0-9a-fA-F]+ ';'
-     * 
-     * Well-formedness constraint: Legal Character
-     * 
-     * Characters referred to using character references must match 
-     * the production for Char.
-     *
-     * If the character reference begins with "&#x ", the digits and letters 
-     * up to the terminating ; provide a hexadecimal representation of the 
-     * character's code point in ISO/IEC 10646. If it begins just with "&#", 
-     * the digits up to the terminating ; provide a decimal representation 
-     * of the character's code point.
-     */
-    entityRef=0;
-    if (checkEntities && (byte[0]=='&')) {
-      for (j=1; (j<MAX_BYTES && byte[j-1]!=';'); j++) {
-        if ((ch=getc(stdin))==EOF) {
-          byte[j]=';';
-	  snprintf(buf,sizeof(buf),"EOF in entity reference, terminated to read %s",byteToStr(byteStr,byte,j));
-	  addMessage(buf);
-        } else if (ch<32) {
-          ungetc(ch,stdin);
-          byte[j]=';';
-	  snprintf(buf,sizeof(buf),"character<32 in entity reference, terminated to read %s",byteToStr(byteStr,byte,j));
-	  addMessage(buf);
-	} else {
-          bytenum++;
-          if ((ch<'0' || ch>'9') && (ch<'a' || ch>'z') && (ch<'A' || ch>'Z') && ch!='#' && ch!=';') {  
-            /* FIXME - There are a vast number of characters allowed in a general XML entity
-             * FIXME - reference (see http://www.w3.org/TR/2000/WD-xml-2e-20000814#NT-EntityRef).
-             * FIXME - Here I allow a reduced set of characters sufficient to allow parsing of 
-             * FIXME - numeric character references and the 5 XML entities [Simeon/2005-10-25]
-             */
-   	    snprintf(buf,sizeof(buf),"bad character in entity reference, got 0x%02X, substituted ?",ch);
-	    addMessage(buf);
-            ch='?';
-          }
-          byte[j]=ch;
-        }
-      }
-      contBytes=(j-1);
-      if (byte[contBytes]==';') {
-        if (byte[1]=='#') {
-          if ((unicode=parseNumericCharacterReference(byte))==0) {
-            snprintf(buf,sizeof(buf),"bad numeric character reference: %s",byteToStr(byteStr,byte,contBytes));
- 	    addMessage(buf);
-          }
-	} else if (!validXMLEntity(byte)) {
-          snprintf(buf,sizeof(buf),"illegal XML  entity reference: %s",byteToStr(byteStr,byte,contBytes));
-	  addMessage(buf);
-        }
-      } else {
-        /* There is no limit on the length of an entity, it is defined via:
-         * http://www.w3.org/TR/2000/WD-xml-2e-20000814#NT-EntityRef
-         * [68] EntityRef   ::=    '&' Name ';'
-         *  [5]      Name   ::=    (Letter | '_' | ':') ( NameChar)*
-         *  [4]  NameChar   ::=    Letter | Digit  | '.' | '-' | '_' | ':' | CombiningChar | Extender
-         * ...
-         * However, here we add a local constraint of maximum length 
-         * MAX_BYTES which is more than sufficient to allow numeric character 
-         * references and the 5 XML entities [Simeon/2005-10-25]
-         */
-	snprintf(buf,sizeof(buf),"entity reference too long (local constraint) or not terminated, adding ;");
-	addMessage(buf);
-        byte[++contBytes]=';';
-      }
-    }
-
-    /* check for illegal Unicode chars */
-    if ((error[0]=='\0') && !validUTF8Char(unicode)) {
-      snprintf(buf,sizeof(buf),"illegal UTF-8 code: 0x%04X",unicode);
-      addMessage(buf);
-    }
-
-    if (error[0]=='\0') {
-      if (checkXML1_0Chars && !validXML1_0Char(unicode)) {
-        snprintf(error,sizeof(error),"code not allowed in XML1.0: 0x%04X",unicode);
-      } else if (checkXML1_1Chars && !validXML1_1Char(unicode)) {
-        snprintf(error,sizeof(error),"code not allowed in XML1.1: 0x%04X",unicode);
-      } else { 
-        for (k=0; badChars[k]!=0; k++) {
-          if (unicode==badChars[k]) {
-            snprintf(error,sizeof(error),"bad code: 0x%04X", unicode);
-            break;
-          }
-        }
-      } 
-    }
-
-    if (error[0]!='\0') {
-      numErrors++;
-      if (badMultiByteToMultiChar && j>1) {
-        /* now test individual bytes of bad multibyte char, will always
-         * make substitution for at least the first char.
-         */
-        for (k=0; k<=j; k++) {
-          if (byte[k]>0x7F || (checkXML1_0Chars && !validXML1_0Char((unsigned int)byte[j]))) {
-            byte[k]=substituteChar;
-          }
-        }
-	snprintf(buf,sizeof(buf),"substituted ");
-        addMessage(buf);
-        for (k=0; k<=(j-1); k++) {
-          snprintf(buf,sizeof(buf)," 0x%02X", byte[k]);
-          addMessage(buf);
-        }
-      } else {
-        /* substitute one char for all bytes of bad multibyte char or entity reference
-         */
-        byte[0]=substituteChar;
-        j=1;
-	snprintf(buf,sizeof(buf),"substituted 0x%02X", byte[0]);
-        addMessage(buf);
-      }
-    } else { 
-      /* Finally check for restricted chars that we do a NCR substitution for */
-      if (checkXML1_1Restricted && restrictedXML1_1Char(unicode)) {
-        j=snprintf(buf,sizeof(buf),"&#x%X",unicode);
-        for (k=0; k<=j; k++) { byte[k]=(int)buf[k]; } /* copy char array to int array */
-        snprintf(error,sizeof(error),"code restricted in XML1.1: 0x%04X, substituted NCR: '%s'",unicode,buf);
-      }
+  /*
+   * Records on stdin until it ends
+   */
+  if (lo.records!=RECORDS_NONE) {
+    if (argc>utf8_optind || outFile!=NULL || inPlaceMode || compress || lo.checkpoint!=NULL ||
+        lo.cache!=NULL || batch.outDir!=NULL || batch.outSuffix!=NULL || listFile!=NULL) {
+      fprintf(stderr,"--records takes no files and can't be used with -o, -i, -z, batch mode, --cache or --checkpoint, aborting!\n");
+      exit(1);
+    }
+    j=conditionRecords(lo.records,&opt,quiet,lo.errorsFormat,err,
+                       (lo.stats!=STATS_NONE ? &stats : NULL),threads);
+    utf8condFreeOptions(&opt);
+    if (lo.stats!=STATS_NONE) {
+      printStats(stderr,lo.stats,&stats,now()-startTime);
     }
+    fclose(err);
+    exit(j<0 ? 1 : 0);
+  }
 
-    if (error[0]!='\0') {
-      if (!quiet && (numErrors<=maxErrors || maxErrors==0)) {
-        fprintf(stderr,"Line %ld, char %ld, byte %ld: %s\n",
-                linenum,charnum,bytenum,error);
+  /*
+   * Each file rewritten in place
+   */
+  if (inPlaceMode) {
+    if (argc-utf8_optind<1 || outFile!=NULL || opt.checkOnly || compress ||
+        batch.outDir!=NULL || batch.outSuffix!=NULL || listFile!=NULL || lo.checkpoint!=NULL) {
+      fprintf(stderr,"-i needs files and can't be used with -o, -c, -z, batch mode or --checkpoint, aborting!\n");
+      exit(1);
+    }
+    numFiles=argc-utf8_optind;
+    for (j=utf8_optind; j<argc; j++) {
+      ctx.out=&out;
+      ctx.err=err;
+      ctx.errorsFormat=lo.errorsFormat;
+      ctx.stats=(lo.stats!=STATS_NONE ? &stats : NULL);
+      ctx.name=(numFiles>1 ? argv[j] : NULL);
+      ctx.input=argv[j];
+      ctx.opt=&opt;
+      ctx.quiet=quiet;
+      ctx.threads=1;
+      ctx.inBuf=inBuf;
+      ctx.cache=NULL;
+      if (conditionInPlace(argv[j],&ctx)<0) {
+        fflush(err);
+        fprintf(stderr,"%s, aborting!\n",ctx.failure);
+        exit(1);
       }
-      contBytes=j-1;
     }
+    utf8condFreeOptions(&opt);
+    if (lo.stats!=STATS_NONE) {
+      printStats(stderr,lo.stats,&stats,now()-startTime);
+    }
+    fclose(err);
+    exit(0);
+  }
+
+  /*
+   * Batch mode
+   */
+  if (batch.outDir!=NULL || batch.outSuffix!=NULL || listFile!=NULL) {
+    if (outFile!=NULL) {
+      fprintf(stderr,"Can't use -o in batch mode, use -d or -S, aborting!\n");
+      exit(1);
+    }
+    if (batch.outSuffix!=NULL && batch.outSuffix[0]=='\0' && batch.outDir==NULL) {
+      fprintf(stderr,"Empty -S suffix would overwrite input, aborting!\n");
+      exit(1);
+    }
+    if (batch.outDir==NULL && batch.outSuffix==NULL && !opt.checkOnly) {
+      fprintf(stderr,"Batch mode needs -d or -S for output, or -c, aborting!\n");
+      exit(1);
+    }
+    batch.names=argv+utf8_optind;
+    batch.nfiles=argc-utf8_optind;
+    if (listFile!=NULL) {
+      batch.names=readFileList(listFile,listSep,batch.names,&batch.nfiles);
+    }
+    batch.opt=&opt;
+    batch.quiet=quiet;
+    batch.err=err;
+    batch.errorsFormat=lo.errorsFormat;
+    batch.stats=(lo.stats!=STATS_NONE ? &stats : NULL);
+    batch.compress=(compress && !opt.checkOnly);
+    batch.cache=cache;
+    conditionBatch(&batch,threads);
+    closeCache(cache);
+    utf8condFreeOptions(&opt);
+    if (lo.stats!=STATS_NONE) {
+      printStats(stderr,lo.stats,&stats,now()-startTime);
+    }
+    fclose(err);
+    exit(batch.numFailed>0 ? 1 : 0);
+  }
+
+  /*
+   * One file carried on from a checkpoint
+   */
+  if (lo.checkpoint!=NULL) {
+    if (argc-utf8_optind!=1 || strcmp(argv[utf8_optind],"-")==0 ||
+        (outFile==NULL && !opt.checkOnly) || compress) {
+      fprintf(stderr,"--checkpoint needs one input file and -o (or -c), and not -z, aborting!\n");
+      exit(1);
+    }
+    out.fd=-1;
+    ctx.out=&out;
+    ctx.err=err;
+    ctx.errorsFormat=lo.errorsFormat;
+    ctx.stats=(lo.stats!=STATS_NONE ? &stats : NULL);
+    ctx.name=NULL;
+    ctx.input=argv[utf8_optind];
+    ctx.opt=&opt;
+    ctx.quiet=quiet;
+    ctx.threads=1;
+    ctx.inBuf=inBuf;
+    ctx.cache=NULL;
+    if (conditionCheckpointed(argv[utf8_optind],outFile,lo.checkpoint,&ctx)<0) {
+      fflush(err);
+      fprintf(stderr,"%s, aborting!\n",ctx.failure);
+      exit(1);
+    }
+    utf8condFreeOptions(&opt);
+    if (lo.stats!=STATS_NONE) {
+      printStats(stderr,lo.stats,&stats,now()-startTime);
+    }
+    fclose(err);
+    exit(0);
+  }
 
-    if (!checkOnly) { 
-      for (k=0; k<=contBytes; k++) {
-        putc(byte[k],stdout);
+  /*
+   * Condition each file named on the command line, or stdin if none. If
+   * there is more than one file then error messages start with the file
+   * name.
+   */
+  out.fd=1;
+  out.compress=(compress && !opt.checkOnly);
+  numFiles=argc-utf8_optind;
+  if (outFile!=NULL && !opt.checkOnly) {
+    /* not truncated until it is known not to be an input */
+    if ((out.fd=open(outFile,O_WRONLY|O_CREAT,0666))<0 || fstat(out.fd,&st)!=0) {
+      fprintf(stderr,"Can't open output file '%s': %s, aborting!\n",outFile,strerror(errno));
+      exit(1);
+    }
+    j=utf8_optind;
+    do {
+      const char* name=(numFiles>0 ? argv[j] : "-");
+      if ((strcmp(name,"-")==0 ? fstat(0,&inSt) : stat(name,&inSt))==0 && SAME_FILE(&st,&inSt)) {
+        fprintf(stderr,"Output file '%s' is input '%s', use -i to condition it in place, aborting!\n",
+                outFile,name);
+        exit(1);
       }
+    } while (++j<argc);
+    if (S_ISREG(st.st_mode) && ftruncate(out.fd,0)!=0) {
+      fprintf(stderr,"Can't truncate output file '%s': %s, aborting!\n",outFile,strerror(errno));
+      exit(1);
     }
   }
+  j=utf8_optind;
+  do {
+    const char* name=(numFiles>0 ? argv[j] : "-");
+    ctx.out=&out;
+    ctx.err=err;
+    ctx.errorsFormat=lo.errorsFormat;
+    ctx.stats=(lo.stats!=STATS_NONE ? &stats : NULL);
+    ctx.name=(numFiles>1 ? name : NULL);
+    ctx.input=name;
+    ctx.opt=&opt;
+    ctx.quiet=quiet;
+    ctx.threads=threads;
+    ctx.inBuf=inBuf;
+    ctx.cache=cache;
+    ctx.token=(token.fp!=NULL ? &token : NULL);
+    if (conditionNamed(name,NULL,&ctx)<0) {
+      fflush(err);
+      fprintf(stderr,"%s, aborting!\n",ctx.failure);
+      exit(1);
+    }
+  } while (++j<argc);
 
-  if (!quiet && (numErrors>maxErrors) && (maxErrors!=0)) {
-    fprintf(stderr,"%d additional errors not reported.\n", (numErrors-maxErrors));
+  finishOutput(&out);
+  if (out.error!=0) {
+    fflush(err);
+    fprintf(stderr,"Write error: %s, aborting!\n",strerror(out.error));
+    exit(1);
+  }
+  if (out.fd!=1) {
+    close(out.fd);
+  }
+  if (token.fp!=NULL) {
+    fclose(token.fp);
   }
+  closeCache(cache);
+  utf8condFreeOptions(&opt);
+  if (lo.stats!=STATS_NONE) {
+    printStats(stderr,lo.stats,&stats,now()-startTime);
+  }
+  fclose(err);
   exit(0);
 }
 
 
-/* Returns true unless the character is one of a small set of codes
- * that do not represent legal characters in Unicode.
- *
- * From Unicode 3.2 (http://www.unicode.org/unicode/reports/tr28/#3_1_conformance) 
- * UxD800..UxDFFF are ill-formed 
- *
- * UTF-8 is defined by http://www.ietf.org/rfc/rfc3629.txt
- * (and obsoletes http://www.ietf.org/rfc/rfc2279.txt which, in turn
- * obsoletes http://www.ietf.org/rfc/rfc2044.txt )
- *
- * Ux10FFFF is highest legal UTF-8 code
- * RFC2279 permitted codes greater than Ux10FFFF but RFC3629 does not. 
+/*
+ * Condition the file name ("-" for stdin), writing output to outFile
+ * if not NULL or else ctx->out as it is. Returns the number of errors,
+ * or -1 if the input can't be read or output written.
  */
-int validUTF8Char(unsigned int ch) {
-  return((ch<0xD800 || ch>0xDFFF) && ch<=0x10FFFF);
+int conditionNamed(const char* name, const char* outFile, condContext* ctx) {
+  utf8cond* cond;
+  utf8condStats stats;
+  struct stat st, outSt;
+  int numErrors;
+  int fd;
+
+  ctx->failure[0]='\0';
+  ctx->out->error=0;
+  if (ctx->token!=NULL) {
+    ctx->token->state=TOKEN_OUT;
+  }
+  if (strcmp(name,"-")==0) {
+    fd=0;
+  } else if ((fd=open(name,O_RDONLY))<0) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Can't open input file '%s': %s",name,strerror(errno));
+    return(-1);
+  }
+  if (outFile!=NULL && !ctx->opt->checkOnly) {
+    /* not truncated until it is known not to be the input */
+    if ((ctx->out->fd=open(outFile,O_WRONLY|O_CREAT,0666))<0 || fstat(ctx->out->fd,&outSt)!=0) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Can't open output file '%s': %s",outFile,strerror(errno));
+    } else if (fstat(fd,&st)==0 && SAME_FILE(&outSt,&st)) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Output file '%s' is the input",outFile);
+    } else if (S_ISREG(outSt.st_mode) && ftruncate(ctx->out->fd,0)!=0) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Can't truncate output file '%s': %s",outFile,strerror(errno));
+    }
+    if (ctx->failure[0]!='\0') {
+      if (ctx->out->fd>=0) {
+        close(ctx->out->fd);
+      }
+      if (fd!=0) {
+        close(fd);
+      }
+      return(-1);
+    }
+  }
+  cond=utf8condNew(ctx->opt,writeOutput,(ctx->quiet ? NULL : printError),ctx);
+  if (cond==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  if (ctx->stats!=NULL) {
+    utf8condCollectStats(cond);
+  }
+  numErrors=conditionFile(cond,fd,ctx);
+  if (ctx->stats!=NULL) {
+    utf8condGetStats(cond,&stats);
+    addStats(ctx->stats,&stats);
+  }
+  utf8condFree(cond);
+  if (fd!=0) {
+    close(fd);
+  }
+  if (outFile!=NULL && !ctx->opt->checkOnly) {
+    finishOutput(ctx->out);
+    if (close(ctx->out->fd)!=0 && ctx->out->error==0) {
+      ctx->out->error=errno;
+    }
+  }
+  if (ctx->out->error!=0 && ctx->failure[0]=='\0') {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Write error: %s",strerror(ctx->out->error));
+  }
+  if (ctx->failure[0]!='\0') {
+    return(-1);
+  }
+  if (!ctx->quiet && (numErrors>ctx->opt->maxErrors) && (ctx->opt->maxErrors!=0)) {
+    printUnreported(ctx,numErrors-ctx->opt->maxErrors);
+  }
+  return(numErrors);
 }
 
 
-/* From http://www.w3.org/TR/2000/REC-xml-20001006 
- * (sec 2.2, extracted 16July2001)
- *
- * Legal characters are tab, carriage return, line feed, and the legal 
- * characters of Unicode and ISO/IEC 10646. The versions of these standards 
- * cited in A.1 Normative References were current at the time this document 
- * was prepared. New characters may be added to these standards by amendments 
- * or new editions. Consequently, XML processors must accept any character 
- * in the range specified for Char. The use of "compatibility characters", 
- * as defined in section 6.8 of [Unicode] (see also D21 in section 3.6 of 
- * [Unicode3]), is discouraged.]
- *
- * Character Range
- * Char ::= #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] |
- *                            [#x10000-#x10FFFF]
- * [end excerpt]
+/*
+ * In place (-i). Conditioning never makes the output longer than the
+ * input read so far except where restricted characters are replaced by
+ * references with -X 1.1, so the output is written back over input that
+ * has been read.
+ * Output that would get ahead of the input read is kept in spill until
+ * more is read, and at the end the file is truncated to the output
+ * length. Output that is the same as the input under it is not written,
+ * so a file that needs few changes gets few writes.
  */
-int validXML1_0Char(unsigned int ch) {
-  return(ch==0x09 || ch==0x0A || ch==0x0D ||
-         (ch>=0x20 && ch<=0xD7FF) ||
-         (ch>=0xE000 && ch<=0xFFFD) ||
-         (ch>=0x10000 && ch<=0x10FFFF)); 
-} 
-
-
-/* From http://www.w3.org/TR/xml11/#charsets
- * (sec 2.2, extracted 23Dec2003)
- * 
- * Char ::=  [#x1-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]  
- * RestrictedChar ::= [#x1-#x8] | [#xB-#xC] | [#xE-#x1F] | 
- *                    [#x7F-#x84] | [#x86-#xBF]
- *
- * Spec doesn't seem to say what one should do about RestricterChar.
- * However, http://www.w3.org/International/questions/qa-controls.html
- * says:
- *
- * In XML 1.1 (which is still in Candidate Recommendation stage), if you 
- * need to represent a control code explicitly the simplest alternative 
- * is to use an NCR (numeric character reference). For example, the control 
- * code ESC (Escape) U+001B would be represented by either the &#x1B; 
- * (hexadecimal) or &#27; (decimal) Numeric Character References.
- *
+typedef struct inPlace {
+  int fd;
+  unsigned long long readPos;     /* input read */
+  unsigned long long writePos;    /* output written */
+  const unsigned char* chunk;     /* input last read, at readPos-nchunk */
+  size_t nchunk;
+  unsigned char* spill;           /* SPILL_SIZE bytes of output not written yet */
+  size_t nspill;
+  int error;                      /* errno of a write failure */
+} inPlace;
+
+#define IN_PLACE_BLOCK 4096       /* compared before writing */
+#define SPILL_SIZE (16*IN_BUF_SIZE) /* most output held ahead of the input */
+
+/* Write the n bytes at s at writePos */
+static void putInPlace(inPlace* p, const unsigned char* s, size_t n) {
+  unsigned long long chunkPos=p->readPos-p->nchunk, pos;
+  size_t done, k;
+  ssize_t w;
+
+  for (done=0; done<n && p->error==0; done+=k) {
+    k=(n-done<IN_PLACE_BLOCK ? n-done : IN_PLACE_BLOCK);
+    pos=p->writePos+done;
+    if (pos>=chunkPos && pos+k<=p->readPos &&
+        memcmp(s+done,p->chunk+(pos-chunkPos),k)==0) {
+      continue; /* unchanged */
+    }
+    while ((w=pwrite(p->fd,s+done,k,(off_t)pos))<0 && errno==EINTR);
+    if (w!=(ssize_t)k) {
+      p->error=(w<0 ? errno : EIO);
+    }
+  }
+  p->writePos+=n;
+}
+
+/* Write spill out over input already read, or all of it if all */
+static void drainInPlace(inPlace* p, int all) {
+  size_t n=p->nspill;
+
+  if (!all && p->writePos+n>p->readPos) {
+    n=(size_t)(p->readPos-p->writePos);
+  }
+  putInPlace(p,p->spill,n);
+  memmove(p->spill,p->spill+n,p->nspill-n);
+  p->nspill-=n;
+}
+
+/* Output callback for -i, input passed through unchanged where it came
+ * from needs no copy or write */
+void writeInPlace(void* ctx, const unsigned char* s, size_t n) {
+  inPlace* p=((condContext*)ctx)->inPlace;
+
+  if (p->nspill==0 && s>=p->chunk && s+n<=p->chunk+p->nchunk &&
+      p->readPos-p->nchunk+(unsigned long long)(s-p->chunk)==p->writePos) {
+    p->writePos+=n;
+    return;
+  }
+  if (p->nspill+n>SPILL_SIZE) {
+    drainInPlace(p,0); /* the input under it is in memory */
+    if (p->nspill==0 && p->writePos+n<=p->readPos) {
+      putInPlace(p,s,n);
+      return;
+    }
+    if (p->nspill+n>SPILL_SIZE) {
+      /* not if inPlaceSpill() said it fits */
+      if (p->error==0) {
+        p->error=EFBIG;
+      }
+      return;
+    }
+  }
+  memcpy(p->spill+p->nspill,s,n);
+  p->nspill+=n;
+}
+
+/*
+ * With -X 1.1 or --repair output can get ahead of the input read by more
+ * than SPILL_SIZE, so the file is conditioned once just counting output
+ * before anything is written to it, following writeInPlace(). Sets most
+ * to the most that would be spilled and leaves fd at the start. Returns
+ * 0 with errno set if the file can't be read.
+ */
+typedef struct spillCount {
+  unsigned long long out;         /* output so far */
+  unsigned long long readPos;
+  unsigned long long most;        /* most that would be spilled */
+} spillCount;
+
+static void countSpill(void* ctx, const unsigned char* s, size_t n) {
+  spillCount* sc=(spillCount*)ctx;
+  unsigned long long need=0;
+
+  (void)s;
+  if (sc->out+n>sc->readPos) {
+    need=(sc->out>sc->readPos ? sc->out+n-sc->readPos : n);
+  }
+  if (need>sc->most) {
+    sc->most=need;
+  }
+  sc->out+=n;
+}
+
+static int inPlaceSpill(int fd, const utf8condOptions* opt, unsigned char* buf, unsigned long long* most) {
+  spillCount sc;
+  utf8cond* cond;
+  ssize_t n;
+
+  memset(&sc,0,sizeof(sc));
+  if ((cond=utf8condNew(opt,countSpill,NULL,&sc))==NULL) {
+    errno=ENOMEM;
+    return(0);
+  }
+  while ((n=read(fd,buf,IN_BUF_SIZE))!=0) {
+    if (n<0) {
+      if (errno==EINTR) continue;
+      utf8condFree(cond);
+      return(0);
+    }
+    sc.readPos+=(unsigned long long)n;
+    utf8condFeed(cond,buf,(size_t)n);
+  }
+  utf8condFinish(cond);
+  utf8condFree(cond);
+  *most=sc.most;
+  return(lseek(fd,0,SEEK_SET)==0);
+}
+
+/*
+ * Condition the file name in place. Returns the number of errors, or -1
+ * as conditionNamed(); a write failure leaves the file part rewritten.
  */
-int validXML1_1Char(unsigned int ch) {
-  return((ch>=0x1 && ch<=0xD7FF) ||
-         (ch>=0xE000 && ch<=0xFFFD) ||
-         (ch>=0x10000 && ch<=0x10FFFF)); 
-} 
-
-int restrictedXML1_1Char(unsigned int ch) {
-  return((ch>=0x1 && ch<=0x8) ||
-         (ch>=0xB && ch<=0xC) ||
-         (ch>=0xE && ch<=0x1F) ||
-         (ch>=0x7F && ch<=0x84) ||
-         (ch>=0x86 && ch<=0xBF));
-} 
-
-
-/* Parse a numeric character reference in either decimal or hex
- * notation. Expects b[] to start with codes for &# and to be 
- * terminated with ;
+int conditionInPlace(const char* name, condContext* ctx) {
+  inPlace p;
+  utf8cond* cond;
+  utf8condStats stats;
+  unsigned long long most=0;      /* output held ahead of input */
+  ssize_t n;
+  int numErrors;
+
+  ctx->failure[0]='\0';
+  memset(&p,0,sizeof(p));
+  if ((p.fd=open(name,O_RDWR))<0) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Can't open '%s' to rewrite: %s",name,strerror(errno));
+    return(-1);
+  }
+  /* all that can fail, except writing, is checked before the file is
+   * written to */
+  if ((ctx->opt->checkXML1_1Chars || ctx->opt->repair) && !inPlaceSpill(p.fd,ctx->opt,ctx->inBuf,&most)) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(errno));
+  } else if (most>SPILL_SIZE) {
+    snprintf(ctx->failure,sizeof(ctx->failure),
+             "Can't rewrite '%s' in place, output would get more than %d bytes ahead of input",name,SPILL_SIZE);
+  }
+  if (ctx->failure[0]!='\0') {
+    close(p.fd);
+    return(-1);
+  }
+  if ((p.spill=(unsigned char*)malloc(SPILL_SIZE))==NULL ||
+      (cond=utf8condNew(ctx->opt,writeInPlace,(ctx->quiet ? NULL : printError),ctx))==NULL) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Out of memory");
+    free(p.spill);
+    close(p.fd);
+    return(-1);
+  }
+  ctx->inPlace=&p;
+  if (ctx->stats!=NULL) {
+    utf8condCollectStats(cond);
+  }
+  while (p.error==0 && (n=read(p.fd,ctx->inBuf,IN_BUF_SIZE))!=0) {
+    if (n<0) {
+      if (errno==EINTR) continue;
+      snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(errno));
+      break;
+    }
+    if (p.readPos==0 && compressedInput(ctx->inBuf,(size_t)n)) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Can't rewrite compressed '%s' in place",name);
+      break;
+    }
+    p.chunk=ctx->inBuf;
+    p.nchunk=(size_t)n;
+    p.readPos+=(unsigned long long)n;
+    utf8condFeed(cond,ctx->inBuf,(size_t)n);
+    drainInPlace(&p,0);
+  }
+  numErrors=utf8condFinish(cond);
+  if (ctx->failure[0]=='\0') {
+    drainInPlace(&p,1);
+    if (p.error==0 && ftruncate(p.fd,(off_t)p.writePos)!=0) {
+      p.error=errno;
+    }
+  }
+  if (ctx->stats!=NULL) {
+    utf8condGetStats(cond,&stats);
+    addStats(ctx->stats,&stats);
+  }
+  utf8condFree(cond);
+  free(p.spill);
+  ctx->inPlace=NULL;
+  if (close(p.fd)!=0 && p.error==0) {
+    p.error=errno;
+  }
+  if (p.error!=0 && ctx->failure[0]=='\0') {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Write error: %s",strerror(p.error));
+  }
+  if (ctx->failure[0]!='\0') {
+    return(-1);
+  }
+  if (!ctx->quiet && (numErrors>ctx->opt->maxErrors) && (ctx->opt->maxErrors!=0)) {
+    printUnreported(ctx,numErrors-ctx->opt->maxErrors);
+  }
+  return(numErrors);
+}
+
+
+/*
+ * Daemon mode (--serve). Each of the -j threads accepts connections on
+ * the Unix socket and conditions any number of requests on each, with
+ * its own buffers kept from one request to the next. A request is a
+ * line with the length of the payload followed by any of -c -q -x -l -m,
+ * -X type, -s char, -e num and --errors-format=fmt (on top of the
+ * options the server was started with), then the payload. The reply is
+ * a line
  *
- * Returns: unicode code point on success
- *          0                  on failure 
+ *   numErrors numChanged outputLength messagesLength
  *
- * Note that #x0 is not a valid XML Char and so can safely be used 
- * as the failure return value. 
- * See http://www.w3.org/TR/2000/WD-xml-2e-20000814#sec-references
+ * then the conditioned output and the messages. The whole payload is
+ * read before the reply is written, so a client may write a request
+ * before reading anything. A bad request gets numErrors -1 with the
+ * reason as the messages and the connection is closed. So does one
+ * with a payload longer than SERVE_MAX, output or messages that grow
+ * past that, or one that runs out of memory; the server carries on.
  */
-unsigned int parseNumericCharacterReference(int b[]) {
-  int j;
-  unsigned int unicode=0;
-  if (b[2]=='x') {
-    /* hex */
-    for (j=3; b[j]!=';'; j++) {
-      unicode*=16;
-      if (b[j]>='0' && b[j]<='9') {
-        unicode+=b[j]-'0';
-      } else if (b[j]>='a' && b[j]<='f') {
-        unicode+=b[j]-'a'+10;
-      } else if (b[j]>='A' && b[j]<='F') {
-        unicode+=b[j]-'A'+10;
-      } else {
-        return(0);
-      } 
+#define SERVE_LINE 1024           /* longest request line */
+#define SERVE_MAX (64*1024*1024)  /* longest payload, and messages */
+
+typedef struct serveBuffer {
+  unsigned char* s;
+  size_t n, max;
+  int failed;                     /* out of memory, the rest is dropped */
+} serveBuffer;
+
+typedef struct serveJob {
+  int fd;                         /* listening socket */
+  const utf8condOptions* opt;
+  int quiet;
+  int errorsFormat;
+} serveJob;
+
+/* Each thread accepts connections with buffers of its own */
+typedef struct serveThread {
+  serveJob* job;
+  unsigned char* inBuf;           /* IN_BUF_SIZE bytes */
+  serveBuffer reply;
+} serveThread;
+
+typedef struct serveConn {
+  int fd;
+  unsigned char* buf;             /* IN_BUF_SIZE bytes read ahead */
+  size_t pos, len;
+  int error;                      /* errno of a read failure */
+} serveConn;
+
+/* Output callback for --serve, output is kept for the reply */
+void writeServe(void* ctx, const unsigned char* s, size_t n) {
+  serveBuffer* b=((condContext*)ctx)->reply;
+  unsigned char* grown;
+  size_t max;
+
+  if (b->failed) {
+    return;
+  }
+  if (b->n+n>b->max) {
+    max=(b->n+n>2*b->max ? b->n+n : 2*b->max);
+    if ((grown=(unsigned char*)realloc(b->s,max))==NULL) {
+      b->failed=1;
+      return;
     }
-  } else {
-    /* decimal */
-    for (j=2; b[j]!=';'; j++) {
-      unicode*=10;
-      if (b[j]>='0' && b[j]<='9') {
-        unicode+=b[j]-'0';
+    b->s=grown;
+    b->max=max;
+  }
+  memcpy(b->s+b->n,s,n);
+  b->n+=n;
+}
+
+/* Make sure there is input in c->buf, returns 0 at end or on error */
+static int serveFill(serveConn* c) {
+  ssize_t n;
+
+  if (c->pos<c->len) {
+    return(1);
+  }
+  while ((n=read(c->fd,c->buf,IN_BUF_SIZE))<0 && errno==EINTR);
+  if (n<0) {
+    c->error=errno;
+  }
+  c->pos=0;
+  c->len=(n>0 ? (size_t)n : 0);
+  return(n>0);
+}
+
+/* Read a request line into line, returns 0 at end of connection and
+ * -1 if it is too long */
+static int serveLine(serveConn* c, char* line) {
+  size_t n=0;
+
+  while (serveFill(c)) {
+    if (c->buf[c->pos]=='\n') {
+      c->pos++;
+      line[n]='\0';
+      return(1);
+    }
+    if (n==SERVE_LINE-1) {
+      return(-1);
+    }
+    line[n++]=(char)c->buf[c->pos++];
+  }
+  return(n>0 ? -1 : 0);
+}
+
+/* Set length and options from a request line, returns an explanation
+ * if it is bad */
+static const char* serveParse(char* line, unsigned long long* length, utf8condOptions* opt,
+                              int* quiet, int* errorsFormat) {
+  char* save=NULL;
+  char* w=strtok_r(line," \t\r",&save);
+  char* end;
+  char* v;
+
+  if (w==NULL || (*length=strtoull(w,&end,10),*end!='\0')) {
+    return("request must start with the payload length");
+  }
+  if (*length>SERVE_MAX) {
+    return("payload too long");
+  }
+  while ((w=strtok_r(NULL," \t\r",&save))!=NULL) {
+    if (strcmp(w,"-c")==0) {
+      opt->checkOnly=1;
+    } else if (strcmp(w,"-q")==0) {
+      *quiet=1;
+    } else if (strcmp(w,"-x")==0) {
+      opt->checkXML1_0Chars=1;
+    } else if (strcmp(w,"-l")==0) {
+      opt->checkOverlong=0;
+    } else if (strcmp(w,"-m")==0) {
+      opt->badMultiByteToMultiChar=1;
+    } else if (strncmp(w,"--repair=",9)==0) {
+      if (!utf8condSetRepair(opt,w+9)) {
+        return("bad value for --repair");
+      }
+    } else if (strncmp(w,"--errors-format=",16)==0) {
+      if (strcmp(w+16,"text")==0) {
+        *errorsFormat=ERRORS_TEXT;
+      } else if (strcmp(w+16,"jsonl")==0) {
+        *errorsFormat=ERRORS_JSONL;
+      } else if (strcmp(w+16,"csv")==0) {
+        *errorsFormat=ERRORS_CSV;
       } else {
-        return(0);
-      } 
+        return("bad value for --errors-format");
+      }
+    } else if ((strcmp(w,"-X")==0 || strcmp(w,"-s")==0 || strcmp(w,"-e")==0)) {
+      if ((v=strtok_r(NULL," \t\r",&save))==NULL) {
+        return("missing value for option");
+      }
+      if (w[1]=='X' && !utf8condSetXML(opt,v)) {
+        return("bad value for -X");
+      } else if (w[1]=='s') {
+        opt->substituteChar=v[0];
+      } else if (w[1]=='e') {
+        opt->maxErrors=(int)strtoul(v,NULL,0);
+      }
+    } else {
+      return("unknown option");
     }
   }
-  return(unicode);
+  return(NULL);
 }
 
+/* Write all n bytes to the connection, 0 if it went away */
+static int serveSend(int fd, const void* s, size_t n) {
+  ssize_t w;
 
-/* Returns true if the entity passed in is one of the 5 pre-defined
- * valid non-numerical entities allowed in XML:
- *   &amp; &apos; &quot; &gt; &lt;
- * Returns false otherwise 
- */
-int validXMLEntity(int b[]) {
-  return( b[0]=='&' &&
-          ( (b[1]=='a' && b[2]=='m' && b[3]=='p' && b[4]==';') ||
-            (b[1]=='a' && b[2]=='p' && b[3]=='o' && b[4]=='s' && b[5]==';') ||
-            (b[1]=='q' && b[2]=='u' && b[3]=='o' && b[4]=='t' && b[5]==';') ||
-            (b[1]=='g' && b[2]=='t' && b[3]==';') ||
-            (b[1]=='l' && b[2]=='t' && b[3]==';') ) );
+  while (n>0) {
+    if ((w=send(fd,s,n,MSG_NOSIGNAL))<0) {
+      if (errno==EINTR) continue;
+      return(0);
+    }
+    s=(const char*)s+w;
+    n-=(size_t)w;
+  }
+  return(1);
+}
+
+/* Reply to a request that can't be done, the connection is then closed */
+static void serveRefuse(int fd, const char* why) {
+  char head[64];
+
+  snprintf(head,sizeof(head),"-1 0 0 %lu\n",(unsigned long int)strlen(why));
+  if (serveSend(fd,head,strlen(head))) {
+    serveSend(fd,why,strlen(why));
+  }
+}
+
+/* Condition requests on connection fd until it is closed */
+static void serveConnection(serveJob* job, int fd, unsigned char* inBuf, serveBuffer* reply) {
+  serveConn conn;
+  condContext ctx;
+  utf8condOptions opt;
+  utf8cond* cond;
+  char line[SERVE_LINE];
+  char head[128];
+  const char* bad;
+  char* msgs;
+  size_t nmsgs, k;
+  unsigned long long length;
+  int r, numErrors;
+
+  memset(&conn,0,sizeof(conn));
+  conn.fd=fd;
+  conn.buf=inBuf;
+  memset(&ctx,0,sizeof(ctx));
+  ctx.input="-";
+  ctx.reply=reply;
+  while ((r=serveLine(&conn,line))!=0) {
+    opt=*job->opt;
+    ctx.opt=&opt;
+    ctx.quiet=job->quiet;
+    ctx.errorsFormat=job->errorsFormat;
+    if ((bad=(r<0 ? "request line too long" :
+              serveParse(line,&length,&opt,&ctx.quiet,&ctx.errorsFormat)))!=NULL) {
+      serveRefuse(fd,bad);
+      return;
+    }
+    if ((ctx.err=open_memstream(&msgs,&nmsgs))==NULL) {
+      serveRefuse(fd,"out of memory");
+      return;
+    }
+    if ((cond=utf8condNew(&opt,writeServe,(ctx.quiet ? NULL : printError),&ctx))==NULL) {
+      fclose(ctx.err);
+      free(msgs);
+      serveRefuse(fd,"out of memory");
+      return;
+    }
+    if (!ctx.quiet) {
+      printErrorsHeader(ctx.err,ctx.errorsFormat);
+    }
+    reply->n=0;
+    reply->failed=0;
+    while (length>0 && serveFill(&conn) && !reply->failed && reply->n<=SERVE_MAX &&
+           ftell(ctx.err)<=SERVE_MAX) {
+      k=conn.len-conn.pos;
+      if (k>length) {
+        k=(size_t)length;
+      }
+      utf8condFeed(cond,conn.buf+conn.pos,k);
+      conn.pos+=k;
+      length-=k;
+    }
+    numErrors=utf8condFinish(cond);
+    snprintf(head,sizeof(head),"%d %lu",numErrors,utf8condNumChanged(cond));
+    utf8condFree(cond);
+    if (!ctx.quiet && (numErrors>opt.maxErrors) && (opt.maxErrors!=0)) {
+      printUnreported(&ctx,numErrors-opt.maxErrors);
+    }
+    bad=(reply->failed || ferror(ctx.err) ? "out of memory" :
+         reply->n>SERVE_MAX || ftell(ctx.err)>SERVE_MAX ? "output or messages too long" : NULL);
+    if (fclose(ctx.err)!=0 && bad==NULL) {
+      bad="out of memory";
+    }
+    if (bad!=NULL || length>0) {
+      free(msgs);
+      if (bad!=NULL) {
+        serveRefuse(fd,bad);
+      }
+      return; /* or the client went away part way */
+    }
+    snprintf(head+strlen(head),sizeof(head)-strlen(head)," %lu %lu\n",
+             (unsigned long int)reply->n,(unsigned long int)nmsgs);
+    r=(serveSend(fd,head,strlen(head)) && serveSend(fd,reply->s,reply->n) &&
+       serveSend(fd,msgs,nmsgs));
+    free(msgs);
+    if (!r) {
+      return;
+    }
+  }
+}
+
+void* serveWork(void* arg) {
+  serveThread* t=(serveThread*)arg;
+  int fd;
+
+  for (;;) {
+    if ((fd=accept(t->job->fd,NULL,NULL))<0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue;
+      fprintf(stderr,"Can't accept connection: %s, aborting!\n",strerror(errno));
+      exit(1);
+    }
+    serveConnection(t->job,fd,t->inBuf,&t->reply);
+    close(fd);
+  }
 }
 
-char* byteToStr(char* byteStr, int* byte, int n) {
+/* Listen on the Unix socket path and serve requests, never returns */
+void serve(const char* path, const utf8condOptions* opt, int quiet, int errorsFormat, int threads) {
+  struct sockaddr_un addr;
+  struct stat st;
+  serveJob job;
+  serveThread* t;
+  pthread_t tid;
   int j;
-  for (j=0; j<=n; j++) {
-    byteStr[j]=(char)byte[j];
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  if (strlen(path)>=sizeof(addr.sun_path)) {
+    fprintf(stderr,"Socket name '%s' too long, aborting!\n",path);
+    exit(1);
+  }
+  strcpy(addr.sun_path,path);
+  if (lstat(path,&st)==0 && S_ISSOCK(st.st_mode)) {
+    unlink(path); /* left by an earlier server */
   }
-  byteStr[j]='\0';
-  return(byteStr);
+  if ((job.fd=socket(AF_UNIX,SOCK_STREAM,0))<0 ||
+      bind(job.fd,(struct sockaddr*)&addr,sizeof(addr))!=0 ||
+      listen(job.fd,SOMAXCONN)!=0) {
+    fprintf(stderr,"Can't listen on '%s': %s, aborting!\n",path,strerror(errno));
+    exit(1);
+  }
+  signal(SIGPIPE,SIG_IGN);
+  job.opt=opt;
+  job.quiet=quiet;
+  job.errorsFormat=errorsFormat;
+  if ((t=(serveThread*)calloc(threads,sizeof(serveThread)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  for (j=0; j<threads; j++) {
+    t[j].job=&job;
+    if ((t[j].inBuf=(unsigned char*)malloc(IN_BUF_SIZE))==NULL) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+    /* this thread is the last */
+    if (j<threads-1 && pthread_create(&tid,NULL,serveWork,&t[j])!=0) {
+      fprintf(stderr,"Can't start threads, aborting!\n");
+      exit(1);
+    }
+  }
+  serveWork(&t[threads-1]);
+  exit(1);
 }
 
+
 /*
- * Add message to error string, uses global 'error' to accumulate errors string
+ * --records, many documents over one pipe. Records are read from stdin
+ * and each is conditioned on its own, as if it were a file: counts start
+ * again and -e applies to each. With --records=nul records end with a
+ * NUL byte (or the end of input), each is written to stdout followed by
+ * a NUL (nothing with -c), its messages to err with "record n" as the
+ * name, then a status line (ok or errors, number of errors, record n) to
+ * stderr. With --records=length each record is a --serve request, a line
+ * with the length and options then the payload, and gets a --serve reply
+ * on stdout. A bad request line gets a -1 reply and ends the stream.
+ *
+ * A reader thread splits the input into a ring of slots, -j threads
+ * condition them and the calling thread writes them in order, flushing
+ * after each so a record's result goes out as soon as it is done.
  */
-void addMessage(char* msg) {
-  if (strlen(error)>0 && msg[0]!=' ') {
-    strncat(error, ", ", sizeof(error));
-  }
-  strncat(error, msg, sizeof(error));
+typedef struct recordSlot {
+  unsigned char* in;
+  size_t nin, maxIn;
+  utf8condOptions opt;            /* with the request's options */
+  int quiet;
+  int errorsFormat;
+  const char* bad;                /* why the request is bad, or NULL */
+  serveBuffer out;
+  char* msgs;
+  size_t nmsgs;
+  int numErrors;
+  unsigned long int numChanged;
+  utf8condStats stats;
+  int done;                       /* conditioned, for the writer */
+} recordSlot;
+
+typedef struct recordStream {
+  int format;                     /* RECORDS_NUL or RECORDS_LENGTH */
+  const utf8condOptions* opt;
+  int quiet;
+  int errorsFormat;
+  FILE* err;
+  utf8condStats* stats;           /* totals, NULL if none */
+  recordSlot* slots;
+  int nslots;
+  unsigned long long nread;       /* records in slots so far */
+  unsigned long long next;        /* next record to condition */
+  unsigned long long written;     /* records written, their slots are free */
+  int end;                        /* no more records */
+  int readError;                  /* errno of a read failure */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} recordStream;
+
+/* Wait for the slot for the next record to be free */
+static recordSlot* recordFree(recordStream* r) {
+  recordSlot* slot=&r->slots[r->nread%r->nslots];
+
+  pthread_mutex_lock(&r->lock);
+  while (r->nread>=r->written+r->nslots) {
+    pthread_cond_wait(&r->changed,&r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  slot->nin=0;
+  slot->opt=*r->opt;
+  slot->quiet=r->quiet;
+  slot->errorsFormat=r->errorsFormat;
+  slot->bad=NULL;
+  return(slot);
+}
+
+/* The slot is filled, or with end set there are no more records */
+static void recordFilled(recordStream* r, int end) {
+  pthread_mutex_lock(&r->lock);
+  if (end) {
+    r->end=1;
+  } else {
+    r->nread++;
+  }
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void* recordReader(void* arg) {
+  recordStream* r=(recordStream*)arg;
+  unsigned char* buf;
+  recordSlot* slot=NULL;
+  serveConn conn;
+  char line[SERVE_LINE];
+  unsigned long long length;
+  const unsigned char* p;
+  size_t k;
+  int n;
+
+  if ((buf=(unsigned char*)malloc(IN_BUF_SIZE))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  memset(&conn,0,sizeof(conn));
+  conn.buf=buf;
+  if (r->format==RECORDS_NUL) {
+    while (serveFill(&conn)) {
+      if (slot==NULL) {
+        slot=recordFree(r);
+      }
+      p=(const unsigned char*)memchr(conn.buf+conn.pos,'\0',conn.len-conn.pos);
+      k=(size_t)((p!=NULL ? p : conn.buf+conn.len)-(conn.buf+conn.pos));
+      slot->in=(unsigned char*)growArray(slot->in,&slot->maxIn,slot->nin+k,1);
+      memcpy(slot->in+slot->nin,conn.buf+conn.pos,k);
+      slot->nin+=k;
+      conn.pos+=k;
+      if (p!=NULL) {
+        conn.pos++;
+        recordFilled(r,0);
+        slot=NULL;
+      }
+    }
+    if (slot!=NULL) {
+      recordFilled(r,0); /* the last record needn't end with NUL */
+    }
+  } else {
+    while ((n=serveLine(&conn,line))!=0) {
+      slot=recordFree(r);
+      if ((slot->bad=(n<0 ? "request line too long" :
+                      serveParse(line,&length,&slot->opt,&slot->quiet,&slot->errorsFormat)))!=NULL) {
+        recordFilled(r,0);
+        break;
+      }
+      while (length>0 && serveFill(&conn)) {
+        k=conn.len-conn.pos;
+        if (k>length) {
+          k=(size_t)length;
+        }
+        slot->in=(unsigned char*)growArray(slot->in,&slot->maxIn,slot->nin+k,1);
+        memcpy(slot->in+slot->nin,conn.buf+conn.pos,k);
+        slot->nin+=k;
+        conn.pos+=k;
+        length-=k;
+      }
+      if (length>0) {
+        slot->bad="payload cut short";
+        recordFilled(r,0);
+        break;
+      }
+      recordFilled(r,0);
+    }
+  }
+  r->readError=conn.error;
+  recordFilled(r,1);
+  free(buf);
+  return(NULL);
+}
+
+void* recordWorker(void* arg) {
+  recordStream* r=(recordStream*)arg;
+  recordSlot* slot;
+  condContext ctx;
+  utf8cond* cond;
+  char name[64];
+  unsigned long long k;
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    while (r->next==r->nread && !r->end) {
+      pthread_cond_wait(&r->changed,&r->lock);
+    }
+    if (r->next==r->nread) {
+      pthread_mutex_unlock(&r->lock);
+      return(NULL);
+    }
+    k=r->next++;
+    pthread_mutex_unlock(&r->lock);
+
+    slot=&r->slots[k%r->nslots];
+    if (slot->bad==NULL) {
+      memset(&ctx,0,sizeof(ctx));
+      snprintf(name,sizeof(name),"record %llu",k+1);
+      ctx.name=(r->format==RECORDS_NUL ? name : NULL);
+      ctx.input=(r->format==RECORDS_NUL ? name : "-");
+      ctx.opt=&slot->opt;
+      ctx.quiet=slot->quiet;
+      ctx.errorsFormat=slot->errorsFormat;
+      ctx.reply=&slot->out;
+      slot->out.n=0;
+      slot->out.failed=0;
+      if ((ctx.err=open_memstream(&slot->msgs,&slot->nmsgs))==NULL ||
+          (cond=utf8condNew(&slot->opt,writeServe,(ctx.quiet ? NULL : printError),&ctx))==NULL) {
+        fprintf(stderr,"Out of memory, aborting!\n");
+        exit(1);
+      }
+      if (r->format==RECORDS_LENGTH && !ctx.quiet) {
+        printErrorsHeader(ctx.err,ctx.errorsFormat);
+      }
+      if (r->stats!=NULL) {
+        utf8condCollectStats(cond);
+      }
+      utf8condFeed(cond,slot->in,slot->nin);
+      slot->numErrors=utf8condFinish(cond);
+      slot->numChanged=utf8condNumChanged(cond);
+      if (r->stats!=NULL) {
+        utf8condGetStats(cond,&slot->stats);
+      }
+      utf8condFree(cond);
+      if (!ctx.quiet && (slot->numErrors>slot->opt.maxErrors) && (slot->opt.maxErrors!=0)) {
+        printUnreported(&ctx,slot->numErrors-slot->opt.maxErrors);
+      }
+      fclose(ctx.err);
+      if (slot->out.failed) {
+        free(slot->msgs);
+        slot->bad="out of memory";
+      }
+    }
+    pthread_mutex_lock(&r->lock);
+    slot->done=1;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+/* Condition records from stdin until it ends, see recordStream.
+ * Returns 0, or -1 if the input couldn't be read or the stream ended
+ * with a bad request. */
+int conditionRecords(int format, const utf8condOptions* opt, int quiet, int errorsFormat,
+                     FILE* err, utf8condStats* stats, int threads) {
+  recordStream stream;
+  recordStream* r=&stream;
+  pthread_t reader;
+  pthread_t* workers;
+  recordSlot* slot;
+  unsigned long long k;
+  int j, failed=0;
+
+  memset(r,0,sizeof(*r));
+  r->format=format;
+  r->opt=opt;
+  r->quiet=quiet;
+  r->errorsFormat=errorsFormat;
+  r->err=err;
+  r->stats=stats;
+  r->nslots=2*threads+2;
+  if ((r->slots=(recordSlot*)calloc(r->nslots,sizeof(recordSlot)))==NULL ||
+      (workers=(pthread_t*)malloc(threads*sizeof(pthread_t)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  pthread_mutex_init(&r->lock,NULL);
+  pthread_cond_init(&r->changed,NULL);
+  if (pthread_create(&reader,NULL,recordReader,r)!=0) {
+    fprintf(stderr,"Can't start threads, aborting!\n");
+    exit(1);
+  }
+  for (j=0; j<threads; j++) {
+    if (pthread_create(&workers[j],NULL,recordWorker,r)!=0) {
+      fprintf(stderr,"Can't start threads, aborting!\n");
+      exit(1);
+    }
+  }
+  for (k=0; ; k++) {
+    slot=&r->slots[k%r->nslots];
+    pthread_mutex_lock(&r->lock);
+    while (!slot->done && !(r->end && k==r->nread)) {
+      pthread_cond_wait(&r->changed,&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (!slot->done) {
+      break;
+    }
+    if (slot->bad!=NULL && r->format==RECORDS_NUL) {
+      fprintf(stderr,"record %llu: %s\nfailed 0 record %llu\n",k+1,slot->bad,k+1);
+      failed=1;
+    } else if (slot->bad!=NULL) {
+      printf("-1 0 0 %lu\n%s",(unsigned long int)strlen(slot->bad),slot->bad);
+      fflush(stdout);
+      failed=1;
+    } else if (r->format==RECORDS_LENGTH) {
+      printf("%d %lu %lu %lu\n",slot->numErrors,slot->numChanged,
+             (unsigned long int)slot->out.n,(unsigned long int)slot->nmsgs);
+      fwrite(slot->out.s,1,slot->out.n,stdout);
+      fwrite(slot->msgs,1,slot->nmsgs,stdout);
+      fflush(stdout);
+    } else {
+      fwrite(slot->msgs,1,slot->nmsgs,r->err);
+      fflush(r->err);
+      if (!r->opt->checkOnly) {
+        fwrite(slot->out.s,1,slot->out.n,stdout);
+        putchar('\0');
+        fflush(stdout);
+      }
+      fprintf(stderr,"%s %d record %llu\n",(slot->numErrors>0 ? "errors" : "ok"),slot->numErrors,k+1);
+    }
+    if (slot->bad==NULL) {
+      free(slot->msgs);
+      if (r->stats!=NULL) {
+        addStats(r->stats,&slot->stats);
+      }
+    }
+    pthread_mutex_lock(&r->lock);
+    slot->done=0;
+    r->written++;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_join(reader,NULL);
+  for (j=0; j<threads; j++) {
+    pthread_join(workers[j],NULL);
+  }
+  if (r->readError!=0) {
+    fprintf(stderr,"Read error: %s\n",strerror(r->readError));
+    failed=1;
+  }
+  for (j=0; j<r->nslots; j++) {
+    free(r->slots[j].in);
+    free(r->slots[j].out.s);
+  }
+  free(r->slots);
+  free(workers);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->changed);
+  return(failed ? -1 : 0);
+}
+
+
+/*
+ * Checkpoints for --checkpoint. A run over a file that is appended to
+ * saves where it got to: the input offset with a hash of the bytes just
+ * before it (so a file that was replaced is noticed), the output length
+ * before the held bytes were conditioned as the end of input, and the
+ * conditioner state including those held bytes. The next run truncates
+ * the output to that length and carries on from the offset, so the
+ * output is the same as from conditioning the whole file. The file is
+ * text:
+ *
+ *   utf8conditioner checkpoint 1
+ *   dev ino options offset tail output
+ *   line chr byte numErrors numChanged nheld
+ *   held bytes in hex
+ */
+typedef struct checkpoint {
+  unsigned long long dev, ino;
+  unsigned long long options;     /* see checkpointOptions() */
+  unsigned long long offset;      /* input conditioned or held */
+  unsigned long long tail;        /* tailHash() at offset */
+  unsigned long long output;      /* output length without the end */
+  utf8condState state;
+  unsigned char* held;            /* malloc()ed copy of state.held */
+} checkpoint;
+
+#define TAIL_SIZE 4096            /* bytes hashed before the offset */
+
+/* Options that change the output. With -m and XML1.0 checks the
+ * substitutions depend on earlier characters that aren't kept so a
+ * checkpoint is never used. */
+static unsigned long long checkpointOptions(const utf8condOptions* opt) {
+  if (opt->badMultiByteToMultiChar && opt->checkXML1_0Chars) {
+    return(0);
+  }
+  return(utf8condOptionsHash(opt)^((unsigned long long)opt->substituteChar<<56)^
+         ((unsigned long long)opt->badMultiByteToMultiChar<<48)^((unsigned long long)opt->repair<<40));
+}
+
+/* FNV-1a of up to TAIL_SIZE bytes of fd before offset, 0 if unreadable */
+static unsigned long long tailHash(int fd, unsigned long long offset) {
+  unsigned char buf[TAIL_SIZE];
+  size_t n=(offset<TAIL_SIZE ? (size_t)offset : TAIL_SIZE), j;
+  unsigned long long h=14695981039346656037ULL;
+
+  if (pread(fd,buf,n,(off_t)(offset-n))!=(ssize_t)n) {
+    return(0);
+  }
+  for (j=0; j<n; j++) {
+    h=(h^buf[j])*1099511628211ULL;
+  }
+  return(h|1);
+}
+
+/* Read cpFile into cp, returns 0 if there is none or it is bad */
+static int readCheckpoint(const char* cpFile, checkpoint* cp) {
+  FILE* fp=fopen(cpFile,"r");
+  unsigned long long v[12];
+  unsigned int b;
+  size_t j;
+  int ok;
+
+  cp->held=NULL;
+  if (fp==NULL) {
+    return(0);
+  }
+  ok=(fscanf(fp,"utf8conditioner checkpoint 1 %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+             &v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6],&v[7],&v[8],&v[9],&v[10],&v[11])==12 &&
+      v[11]<=v[3] && (cp->held=(unsigned char*)malloc(v[11]+1))!=NULL);
+  for (j=0; ok && j<v[11]; j++) {
+    ok=(fscanf(fp,"%2x",&b)==1);
+    cp->held[j]=(unsigned char)b;
+  }
+  fclose(fp);
+  if (!ok) {
+    free(cp->held);
+    cp->held=NULL;
+    return(0);
+  }
+  cp->dev=v[0]; cp->ino=v[1]; cp->options=v[2];
+  cp->offset=v[3]; cp->tail=v[4]; cp->output=v[5];
+  cp->state.line=v[6];
+  cp->state.chr=v[7];
+  cp->state.byte=v[8];
+  cp->state.numErrors=(int)v[9];
+  cp->state.numChanged=(unsigned long int)v[10];
+  cp->state.held=cp->held;
+  cp->state.nheld=(size_t)v[11];
+  return(1);
+}
+
+/* Write cp to cpFile, by way of a new file renamed over it */
+static int writeCheckpoint(const char* cpFile, const checkpoint* cp) {
+  char tmp[PATH_MAX];
+  FILE* fp;
+  size_t j;
+  int ok;
+
+  snprintf(tmp,sizeof(tmp),"%s.%ld",cpFile,(long)getpid());
+  if ((fp=fopen(tmp,"w"))==NULL) {
+    return(0);
+  }
+  fprintf(fp,"utf8conditioner checkpoint 1\n%llu %llu %llu %llu %llu %llu\n%llu %llu %llu %d %lu %lu\n",
+          cp->dev,cp->ino,cp->options,cp->offset,cp->tail,cp->output,
+          cp->state.line,cp->state.chr,cp->state.byte,cp->state.numErrors,
+          cp->state.numChanged,(unsigned long int)cp->state.nheld);
+  for (j=0; j<cp->state.nheld; j++) {
+    fprintf(fp,"%02X",cp->state.held[j]);
+  }
+  fprintf(fp,"\n");
+  ok=(fflush(fp)==0 && fsync(fileno(fp))==0);
+  if (fclose(fp)!=0 || !ok || rename(tmp,cpFile)!=0) {
+    unlink(tmp);
+    return(0);
+  }
+  return(1);
+}
+
+/*
+ * Condition the file name, which may have been appended to since the
+ * checkpoint cpFile was written, to outFile (unless -c) and write a new
+ * checkpoint. Returns the number of errors, or -1 as conditionNamed().
+ */
+int conditionCheckpointed(const char* name, const char* outFile, const char* cpFile, condContext* ctx) {
+  checkpoint old, cp;
+  struct stat st, outSt;
+  utf8cond* cond;
+  utf8condStats stats;
+  off_t outLen=0;
+  ssize_t n;
+  int fd, resume, numErrors;
+
+  ctx->failure[0]='\0';
+  ctx->out->error=0;
+  if ((fd=open(name,O_RDONLY))<0 || fstat(fd,&st)!=0) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Can't open input file '%s': %s",name,strerror(errno));
+    return(-1);
+  }
+  memset(&cp,0,sizeof(cp));
+  cp.dev=(unsigned long long)st.st_dev;
+  cp.ino=(unsigned long long)st.st_ino;
+  cp.options=checkpointOptions(ctx->opt);
+  resume=(cp.options!=0 && readCheckpoint(cpFile,&old) && old.dev==cp.dev && old.ino==cp.ino &&
+          old.options==cp.options && old.offset<=(unsigned long long)st.st_size &&
+          old.tail==tailHash(fd,old.offset));
+  if (!ctx->opt->checkOnly) {
+    if ((ctx->out->fd=open(outFile,O_WRONLY|O_CREAT,0666))<0) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Can't open output file '%s': %s",outFile,strerror(errno));
+      close(fd);
+      return(-1);
+    }
+    if (fstat(ctx->out->fd,&outSt)!=0 || SAME_FILE(&st,&outSt)) {
+      snprintf(ctx->failure,sizeof(ctx->failure),
+               "Output file '%s' is the input, use -i to condition it in place",outFile);
+      close(fd);
+      close(ctx->out->fd);
+      return(-1);
+    }
+    if (resume && (unsigned long long)outSt.st_size<old.output) {
+      resume=0; /* output isn't what was written */
+    }
+    outLen=(resume ? (off_t)old.output : 0);
+    if (ftruncate(ctx->out->fd,outLen)!=0 || lseek(ctx->out->fd,outLen,SEEK_SET)<0) {
+      snprintf(ctx->failure,sizeof(ctx->failure),"Can't truncate output file '%s': %s",outFile,strerror(errno));
+      close(fd);
+      close(ctx->out->fd);
+      return(-1);
+    }
+  }
+  if ((cond=utf8condNew(ctx->opt,writeOutput,(ctx->quiet ? NULL : printError),ctx))==NULL ||
+      (resume && !utf8condSetState(cond,&old.state))) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  if (resume) {
+    cp.offset=old.offset;
+    ctx->reported=old.offset; /* the last run reported the held bytes as the end */
+    free(old.held);
+  }
+  if (ctx->stats!=NULL) {
+    utf8condCollectStats(cond);
+  }
+  if (lseek(fd,(off_t)cp.offset,SEEK_SET)<0) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(errno));
+  }
+  while (ctx->failure[0]=='\0' && (n=read(fd,ctx->inBuf,IN_BUF_SIZE))!=0) {
+    if (n<0) {
+      if (errno==EINTR) continue;
+      snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(errno));
+      break;
+    }
+    utf8condFeed(cond,ctx->inBuf,(size_t)n);
+    flushOutput(ctx->out);
+    cp.offset+=(unsigned long long)n;
+  }
+
+  /* the checkpoint is before the held bytes are taken as the end */
+  utf8condGetState(cond,&cp.state);
+  if ((cp.held=(unsigned char*)malloc(cp.state.nheld+1))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  memcpy(cp.held,cp.state.held,cp.state.nheld);
+  cp.state.held=cp.held;
+  cp.tail=tailHash(fd,cp.offset);
+  if (!ctx->opt->checkOnly) {
+    outLen=lseek(ctx->out->fd,0,SEEK_CUR);
+    cp.output=(unsigned long long)(outLen>0 ? outLen : 0);
+  }
+  numErrors=utf8condFinish(cond);
+  flushOutput(ctx->out);
+  if (ctx->stats!=NULL) {
+    utf8condGetStats(cond,&stats);
+    addStats(ctx->stats,&stats);
+  }
+  utf8condFree(cond);
+  close(fd);
+  if (!ctx->opt->checkOnly && close(ctx->out->fd)!=0 && ctx->out->error==0) {
+    ctx->out->error=errno;
+  }
+  if (ctx->out->error!=0 && ctx->failure[0]=='\0') {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Write error: %s",strerror(ctx->out->error));
+  }
+  if (ctx->failure[0]=='\0' && !writeCheckpoint(cpFile,&cp)) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Can't write checkpoint '%s': %s",cpFile,strerror(errno));
+  }
+  free(cp.held);
+  if (ctx->failure[0]!='\0') {
+    return(-1);
+  }
+  if (!ctx->quiet && (numErrors>ctx->opt->maxErrors) && (ctx->opt->maxErrors!=0)) {
+    printUnreported(ctx,numErrors-ctx->opt->maxErrors);
+  }
+  return(numErrors);
+}
+
+
+/*
+ * Condition all input from fd. A regular file is mapped and conditioned
+ * in place so that clean runs are written from the mapping, anything
+ * else (or a file that can't be mapped) is read in blocks into inBuf.
+ * Compressed input is passed to conditionCompressed(). With --cache a
+ * mapped file that is known to need no change is written as it is, or
+ * with -c not even read. Returns the number of errors and sets
+ * ctx->numChanged.
+ */
+int conditionFile(utf8cond* cond, int fd, condContext* ctx) {
+  struct stat st;
+  unsigned char* map;
+  ssize_t n;
+  int numErrors, changed, compressed;
+  int first=1;
+
+  ctx->numChanged=0;
+  if (fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0 &&
+      (map=(unsigned char*)mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0))!=MAP_FAILED) {
+    madvise(map,(size_t)st.st_size,MADV_SEQUENTIAL);
+    compressed=compressedInput(map,(size_t)st.st_size);
+    if (ctx->cache!=NULL && cacheLookup(ctx->cache,&st,&numErrors,&changed) &&
+        (ctx->opt->checkOnly ? ctx->quiet || (numErrors==0 && !changed) :
+                               !compressed && numErrors==0 && !changed)) {
+      /* same as last time */
+      if (!ctx->opt->checkOnly) {
+        if (ctx->token!=NULL) {
+          scanToken(ctx->token,ctx->input,map,(size_t)st.st_size);
+        }
+        startPass(ctx->out,fd,map,(size_t)st.st_size);
+        ctx->out->npass=(size_t)st.st_size;
+        endPass(ctx->out);
+        flushOutput(ctx->out);
+      }
+      ctx->numChanged=(unsigned long int)changed;
+      munmap(map,(size_t)st.st_size);
+      return(numErrors);
+    }
+    if (compressed) {
+      numErrors=conditionCompressed(cond,-1,map,(size_t)st.st_size,ctx);
+      ctx->numChanged=utf8condNumChanged(cond);
+    } else if (ctx->threads>1 && st.st_size>=2*CHUNK_SIZE) {
+      numErrors=conditionParallel(map,(size_t)st.st_size,ctx);
+    } else {
+      if (!ctx->opt->checkOnly) {
+        startPass(ctx->out,fd,map,(size_t)st.st_size);
+      }
+      utf8condFeed(cond,map,(size_t)st.st_size);
+      numErrors=utf8condFinish(cond);
+      ctx->numChanged=utf8condNumChanged(cond);
+      endPass(ctx->out);
+      flushOutput(ctx->out);
+    }
+    munmap(map,(size_t)st.st_size);
+    if (ctx->cache!=NULL && ctx->failure[0]=='\0') {
+      cacheStore(ctx->cache,&st,numErrors,(ctx->numChanged>0));
+    }
+    return(numErrors);
+  }
+  while ((n=read(fd,ctx->inBuf,IN_BUF_SIZE))!=0) {
+    if (n<0) {
+      if (errno==EINTR) continue;
+      snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(errno));
+      break;
+    }
+    if (first && compressedInput(ctx->inBuf,(size_t)n)) {
+      numErrors=conditionCompressed(cond,fd,ctx->inBuf,(size_t)n,ctx);
+      ctx->numChanged=utf8condNumChanged(cond);
+      return(numErrors);
+    }
+    if (first && ctx->threads>1) {
+      numErrors=conditionPipelined(cond,fd,ctx->inBuf,(size_t)n,ctx);
+      ctx->numChanged=utf8condNumChanged(cond);
+      return(numErrors);
+    }
+    first=0;
+    utf8condFeed(cond,ctx->inBuf,(size_t)n);
+    flushOutput(ctx->out);
+  }
+  numErrors=utf8condFinish(cond);
+  ctx->numChanged=utf8condNumChanged(cond);
+  flushOutput(ctx->out);
+  return(numErrors);
+}
+
+
+/* Returns true if the n bytes at s start a gzip member or a zlib stream.
+ * The zlib header is only two bytes and "x^" is one, so the start of
+ * the data must also inflate to something.
+ */
+int compressedInput(const unsigned char* s, size_t n) {
+  z_stream z;
+  unsigned char tmp[4096];
+  int ret;
+
+  if (n>=3 && s[0]==0x1F && s[1]==0x8B && s[2]==8) {
+    return(1);
+  }
+  if (n<3 || (s[0]&0x8F)!=0x08 || ((s[0]<<8)|s[1])%31!=0 || (s[1]&0x20)!=0) {
+    return(0);
+  }
+  memset(&z,0,sizeof(z));
+  if (inflateInit(&z)!=Z_OK) {
+    return(0);
+  }
+  z.next_in=(unsigned char*)s;
+  z.avail_in=(uInt)(n<IN_BUF_SIZE ? n : IN_BUF_SIZE);
+  z.next_out=tmp;
+  z.avail_out=sizeof(tmp);
+  ret=inflate(&z,Z_NO_FLUSH);
+  inflateEnd(&z);
+  return(ret==Z_STREAM_END || (ret==Z_OK && z.avail_out<sizeof(tmp)));
+}
+
+
+/*
+ * Compressed input is inflated on a thread of its own into two buffers
+ * in turn, so that one is being filled while the other is conditioned.
+ * The compressed data is either all in memory (a mapped file) or read
+ * from fd into in. Concatenated gzip members are taken as one stream,
+ * as gzip does.
+ */
+typedef struct inflater {
+  z_stream z;
+  int fd;                         /* -1 if all input is in z already */
+  unsigned char* in;              /* IN_BUF_SIZE for input read from fd */
+  unsigned char* buf[2];          /* IN_BUF_SIZE each of inflated data */
+  size_t len[2];                  /* 0 for the end */
+  int full[2];
+  int ended;                      /* at the end of the last member */
+  char failure[256];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} inflater;
+
+/* Make sure there is input for z, returns 0 at the end of it */
+static int inflateInput(inflater* f) {
+  ssize_t n;
+
+  while (f->z.avail_in==0 && f->fd>=0) {
+    if ((n=read(f->fd,f->in,IN_BUF_SIZE))<0) {
+      if (errno==EINTR) continue;
+      snprintf(f->failure,sizeof(f->failure),"Read error: %s",strerror(errno));
+      return(0);
+    }
+    if (n==0) {
+      break;
+    }
+    f->z.next_in=f->in;
+    f->z.avail_in=(uInt)n;
+  }
+  return(f->z.avail_in>0);
+}
+
+/* Inflate into out, up to IN_BUF_SIZE bytes, returns the number */
+static size_t inflateSome(inflater* f, unsigned char* out) {
+  int ret;
+
+  f->z.next_out=out;
+  f->z.avail_out=IN_BUF_SIZE;
+  while (f->z.avail_out>0 && !f->ended && f->failure[0]=='\0') {
+    if (!inflateInput(f)) {
+      if (f->failure[0]=='\0') {
+        snprintf(f->failure,sizeof(f->failure),"Compressed input is truncated");
+      }
+      break;
+    }
+    ret=inflate(&f->z,Z_NO_FLUSH);
+    if (ret==Z_STREAM_END) {
+      /* another member may follow */
+      if (!inflateInput(f)) {
+        f->ended=(f->failure[0]=='\0');
+        break;
+      }
+      inflateReset(&f->z);
+    } else if (ret!=Z_OK && ret!=Z_BUF_ERROR) {
+      snprintf(f->failure,sizeof(f->failure),"Bad compressed input: %s",
+               (f->z.msg!=NULL ? f->z.msg : zError(ret)));
+    }
+  }
+  return(IN_BUF_SIZE-f->z.avail_out);
+}
+
+static void* inflateThread(void* arg) {
+  inflater* f=(inflater*)arg;
+  size_t n;
+  int k;
+
+  for (k=0; ; k^=1) {
+    pthread_mutex_lock(&f->lock);
+    while (f->full[k]) {
+      pthread_cond_wait(&f->cond,&f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+    n=inflateSome(f,f->buf[k]);
+    pthread_mutex_lock(&f->lock);
+    f->len[k]=n;
+    f->full[k]=1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    if (n==0) {
+      break;
+    }
+  }
+  return(NULL);
+}
+
+/*
+ * Condition compressed input, the first n bytes of which are at in
+ * (inBuf if the rest is to be read from fd, otherwise all of it).
+ * Returns the number of errors.
+ */
+int conditionCompressed(utf8cond* cond, int fd, const unsigned char* in, size_t n, condContext* ctx) {
+  inflater f;
+  pthread_t thread;
+  size_t len;
+  int k, numErrors;
+
+  memset(&f,0,sizeof(f));
+  f.fd=fd;
+  f.in=ctx->inBuf;
+  f.z.next_in=(unsigned char*)in;
+  f.z.avail_in=(uInt)n;
+  if (inflateInit2(&f.z,15+32)!=Z_OK ||
+      (f.buf[0]=(unsigned char*)malloc(2*IN_BUF_SIZE))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  f.buf[1]=f.buf[0]+IN_BUF_SIZE;
+  pthread_mutex_init(&f.lock,NULL);
+  pthread_cond_init(&f.cond,NULL);
+  if (pthread_create(&thread,NULL,inflateThread,&f)!=0) {
+    fprintf(stderr,"Can't create thread, aborting!\n");
+    exit(1);
+  }
+  for (k=0; ; k^=1) {
+    pthread_mutex_lock(&f.lock);
+    while (!f.full[k]) {
+      pthread_cond_wait(&f.cond,&f.lock);
+    }
+    len=f.len[k];
+    pthread_mutex_unlock(&f.lock);
+    if (len==0) {
+      break;
+    }
+    utf8condFeed(cond,f.buf[k],len);
+    flushOutput(ctx->out);
+    pthread_mutex_lock(&f.lock);
+    f.full[k]=0;
+    pthread_cond_broadcast(&f.cond);
+    pthread_mutex_unlock(&f.lock);
+  }
+  pthread_join(thread,NULL);
+  numErrors=utf8condFinish(cond);
+  flushOutput(ctx->out);
+  if (f.failure[0]!='\0') {
+    snprintf(ctx->failure,sizeof(ctx->failure),"%s",f.failure);
+  }
+  inflateEnd(&f.z);
+  pthread_mutex_destroy(&f.lock);
+  pthread_cond_destroy(&f.cond);
+  free(f.buf[0]);
+  return(numErrors);
+}
+
+
+/*
+ * Verdict cache for --cache. dir/index holds a cacheRecord for each file
+ * conditioned, a later record for the same file and options replaces an
+ * earlier one. A file is taken to be unchanged if its device, inode,
+ * size, modification and change times are all the same; the change time
+ * can't be set back so any rewrite is noticed. Records that don't check
+ * out, such as one cut short, are ignored. The index is rewritten
+ * without replaced records once they are more than half of it.
+ */
+static unsigned long long cacheCheck(const cacheRecord* r) {
+  const unsigned char* b=(const unsigned char*)r;
+  unsigned long long h=14695981039346656037ULL;
+  size_t j;
+  for (j=0; j<offsetof(cacheRecord,check); j++) {
+    h=(h^b[j])*1099511628211ULL;
+  }
+  return(h|1);
+}
+
+static void cacheKey(cacheRecord* r, const struct stat* st, unsigned long long options) {
+  memset(r,0,sizeof(*r));
+  r->dev=(unsigned long long)st->st_dev;
+  r->ino=(unsigned long long)st->st_ino;
+  r->size=(unsigned long long)st->st_size;
+  r->mtime=(long long)st->st_mtim.tv_sec*1000000000LL+st->st_mtim.tv_nsec;
+  r->ctime=(long long)st->st_ctim.tv_sec*1000000000LL+st->st_ctim.tv_nsec;
+  r->options=options;
+}
+
+/* Slot for the file and options of r, empty if there is none */
+static cacheRecord* cacheSlot(const verdictCache* c, const cacheRecord* r) {
+  size_t k=(size_t)((r->dev*0x9E3779B97F4A7C15ULL)^(r->ino*0xC2B2AE3D27D4EB4FULL)^r->options);
+  for (k&=c->size-1; c->table[k].check!=0; k=(k+1)&(c->size-1)) {
+    if (c->table[k].dev==r->dev && c->table[k].ino==r->ino && c->table[k].options==r->options) {
+      break;
+    }
+  }
+  return(&c->table[k]);
+}
+
+verdictCache* openCache(const char* dir, const utf8condOptions* opt) {
+  verdictCache* c;
+  cacheRecord* all=NULL;
+  cacheRecord* slot;
+  struct stat st;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  size_t n=0, used=0, j;
+  ssize_t got;
+  int fd;
+
+  if ((c=(verdictCache*)calloc(1,sizeof(verdictCache)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  c->options=utf8condOptionsHash(opt);
+  snprintf(path,sizeof(path),"%s/index",dir);
+  if ((mkdir(dir,0777)!=0 && errno!=EEXIST) ||
+      (c->fd=open(path,O_RDWR|O_CREAT|O_APPEND,0666))<0 || fstat(c->fd,&st)!=0) {
+    fprintf(stderr,"Can't open cache '%s': %s, aborting!\n",path,strerror(errno));
+    exit(1);
+  }
+  n=(size_t)st.st_size/sizeof(cacheRecord);
+  if (n>0 && ((all=(cacheRecord*)malloc(n*sizeof(cacheRecord)))==NULL ||
+              (got=pread(c->fd,all,n*sizeof(cacheRecord),0))<0)) {
+    fprintf(stderr,"Can't read cache '%s': %s, aborting!\n",path,strerror(errno));
+    exit(1);
+  }
+  if (n>0) {
+    n=(size_t)got/sizeof(cacheRecord);
+  }
+  for (c->size=64; c->size<2*n; c->size*=2);
+  if ((c->table=(cacheRecord*)calloc(c->size,sizeof(cacheRecord)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  for (j=0; j<n; j++) {
+    if (all[j].check!=cacheCheck(&all[j])) {
+      continue;
+    }
+    slot=cacheSlot(c,&all[j]);
+    used+=(slot->check==0);
+    *slot=all[j];
+  }
+  free(all);
+  if (n>2*used+1024) {
+    /* compact, records appended by another run meanwhile are lost */
+    snprintf(tmp,sizeof(tmp),"%s/index.%ld",dir,(long)getpid());
+    if ((fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0666))>=0) {
+      for (j=0; j<c->size; j++) {
+        if (c->table[j].check!=0 && write(fd,&c->table[j],sizeof(cacheRecord))!=sizeof(cacheRecord)) {
+          break;
+        }
+      }
+      if (close(fd)==0 && j==c->size && rename(tmp,path)==0) {
+        close(c->fd);
+        if ((c->fd=open(path,O_WRONLY|O_APPEND))<0) {
+          fprintf(stderr,"Can't open cache '%s': %s, aborting!\n",path,strerror(errno));
+          exit(1);
+        }
+      } else {
+        unlink(tmp);
+      }
+    }
+  }
+  return(c);
+}
+
+/* Returns true if there is a verdict for the file st is for, as it is
+ * now, and sets numErrors and changed */
+int cacheLookup(const verdictCache* c, const struct stat* st, int* numErrors, int* changed) {
+  cacheRecord r;
+  const cacheRecord* slot;
+
+  cacheKey(&r,st,c->options);
+  slot=cacheSlot(c,&r);
+  if (slot->check==0 || slot->size!=r.size || slot->mtime!=r.mtime || slot->ctime!=r.ctime) {
+    return(0);
+  }
+  *numErrors=slot->numErrors;
+  *changed=slot->changed;
+  return(1);
+}
+
+/* Append the verdict for the file st is for unless it is known. Returns
+ * 0 if it can't be written, the cache is only an aid so callers carry on */
+int cacheStore(verdictCache* c, const struct stat* st, int numErrors, int changed) {
+  cacheRecord r;
+  int numOld, changedOld;
+
+  if (cacheLookup(c,st,&numOld,&changedOld) && numOld==numErrors && changedOld==changed) {
+    return(1);
+  }
+  cacheKey(&r,st,c->options);
+  r.numErrors=numErrors;
+  r.changed=changed;
+  r.check=cacheCheck(&r);
+  return(write(c->fd,&r,sizeof(r))==sizeof(r));
+}
+
+void closeCache(verdictCache* c) {
+  if (c!=NULL) {
+    close(c->fd);
+    free(c->table);
+    free(c);
+  }
+}
+
+
+/*
+ * Parallel conditioning for -j. The mapped file is split into parts of
+ * about CHUNK_SIZE at points chosen by utf8condSplitPoint() and the parts
+ * conditioned on a work queue, each starting its counts from zero (but
+ * with the byte count set to the offset of the part, which is known).
+ * Parts are finished in order by writing their output, and the errors
+ * with line and character positions shifted by the totals of all earlier
+ * parts, so that everything is exactly as for a single thread. Parts
+ * are not conditioned more than 2 per thread ahead of the one being
+ * written to limit the memory used.
+ */
+typedef struct partSpan {
+  const unsigned char* s;         /* NULL if the bytes are in pool */
+  size_t n;
+} partSpan;
+
+typedef struct partError {
+  utf8condError e;
+  int numErrors;                  /* errors in the part so far, messages
+                                     for restricted chars are not counted */
+} partError;
+
+typedef struct part {
+  size_t start, end;              /* range of input */
+  const unsigned char* map;
+  utf8cond* cond;
+  int maxReport;                  /* errors to keep, 0 for all */
+  partSpan* spans;
+  size_t nspans, maxSpans;
+  unsigned char* pool;
+  size_t npool, maxPool;
+  partError* errors;
+  size_t nerrors, maxErrs;
+  int numErrors;
+  unsigned long int numChanged;
+  unsigned long long lines;       /* number of newlines */
+  unsigned long long chars;       /* number of characters */
+  utf8condStats stats;
+} part;
+
+typedef struct partJob {
+  const unsigned char* map;
+  condContext* ctx;
+  part* parts;
+  int nparts;
+  unsigned long long lines;       /* totals for parts written */
+  unsigned long long chars;
+  int numErrors;
+} partJob;
+
+void* growArray(void* a, size_t* max, size_t need, size_t size) {
+  if (need>*max) {
+    *max=(need>2*(*max) ? need : 2*(*max));
+    if ((a=realloc(a,(*max)*size))==NULL) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+  }
+  return(a);
+}
+
+/* Output callback for a part, spans in the mapping are kept as pointers */
+void partWrite(void* ctx, const unsigned char* s, size_t n) {
+  part* p=(part*)ctx;
+  partSpan* last=(p->nspans>0 ? &p->spans[p->nspans-1] : NULL);
+
+  if (s>=p->map+p->start && s<p->map+p->end) {
+    if (last!=NULL && last->s!=NULL && last->s+last->n==s) {
+      last->n+=n;
+      return;
+    }
+  } else {
+    p->pool=(unsigned char*)growArray(p->pool,&p->maxPool,p->npool+n,1);
+    memcpy(p->pool+p->npool,s,n);
+    p->npool+=n;
+    s=NULL;
+    if (last!=NULL && last->s==NULL) {
+      last->n+=n;
+      return;
+    }
+  }
+  p->spans=(partSpan*)growArray(p->spans,&p->maxSpans,p->nspans+1,sizeof(partSpan));
+  p->spans[p->nspans].s=s;
+  p->spans[p->nspans].n=n;
+  p->nspans++;
+}
+
+/* Error callback for a part, keep records up to the first maxReport errors */
+void partReport(void* ctx, const utf8condError* e) {
+  part* p=(part*)ctx;
+  int numErrors=utf8condNumErrors(p->cond);
+
+  if (p->maxReport!=0 && numErrors>p->maxReport) {
+    return;
+  }
+  p->errors=(partError*)growArray(p->errors,&p->maxErrs,p->nerrors+1,sizeof(partError));
+  p->errors[p->nerrors].e=*e;
+  p->errors[p->nerrors].numErrors=numErrors;
+  p->nerrors++;
+}
+
+void partWork(void* arg, int k, int thread) {
+  partJob* job=(partJob*)arg;
+  part* p=&job->parts[k];
+  utf8condOptions opt=*job->ctx->opt;
+  unsigned long long line, chr, byte;
+
+  (void)thread;
+  opt.maxErrors=0; /* limit is applied when written */
+  if ((p->cond=utf8condNew(&opt,partWrite,(job->ctx->quiet ? NULL : partReport),p))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  utf8condSetPosition(p->cond,1,0,p->start);
+  if (job->ctx->stats!=NULL) {
+    utf8condCollectStats(p->cond);
+  }
+  utf8condFeed(p->cond,job->map+p->start,p->end-p->start);
+  p->numErrors=utf8condFinish(p->cond);
+  p->numChanged=utf8condNumChanged(p->cond);
+  utf8condGetStats(p->cond,&p->stats);
+  utf8condPosition(p->cond,&line,&chr,&byte);
+  p->lines=line-1;
+  p->chars=chr;
+  utf8condFree(p->cond);
+}
+
+void partFinish(void* arg, int k) {
+  partJob* job=(partJob*)arg;
+  part* p=&job->parts[k];
+  condContext* ctx=job->ctx;
+  size_t j, pool=0;
+
+  for (j=0; j<p->nerrors; j++) {
+    if (job->numErrors+p->errors[j].numErrors<=ctx->opt->maxErrors || ctx->opt->maxErrors==0) {
+      p->errors[j].e.line+=job->lines;
+      p->errors[j].e.chr+=job->chars;
+      printError(ctx,&p->errors[j].e);
+    }
+  }
+  job->numErrors+=p->numErrors;
+  ctx->numChanged+=p->numChanged;
+  if (ctx->stats!=NULL) {
+    addStats(ctx->stats,&p->stats);
+  }
+  job->lines+=p->lines;
+  job->chars+=p->chars;
+  for (j=0; j<p->nspans; j++) {
+    if (p->spans[j].s!=NULL) {
+      writeOutput(ctx,p->spans[j].s,p->spans[j].n);
+    } else {
+      writeOutput(ctx,p->pool+pool,p->spans[j].n);
+      pool+=p->spans[j].n;
+    }
+  }
+  flushOutput(ctx->out);
+  free(p->spans);
+  free(p->pool);
+  free(p->errors);
+}
+
+int conditionParallel(const unsigned char* map, size_t len, condContext* ctx) {
+  partJob job;
+  size_t start, end;
+  part* p;
+
+  memset(&job,0,sizeof(job));
+  job.map=map;
+  job.ctx=ctx;
+  if ((job.parts=(part*)calloc(len/CHUNK_SIZE+1,sizeof(part)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  for (start=0; start<len; start=end) {
+    end=(len-start<2*CHUNK_SIZE ? len : utf8condSplitPoint(ctx->opt,map,len,start+CHUNK_SIZE));
+    p=&job.parts[job.nparts++];
+    p->start=start;
+    p->end=end;
+    p->map=map;
+    p->maxReport=ctx->opt->maxErrors;
+  }
+  runWorkQueue(job.nparts,ctx->threads,2*ctx->threads,partWork,partFinish,&job);
+  free(job.parts);
+  return(job.numErrors);
+}
+
+
+/*
+ * Input that can't be mapped, such as a pipe, is conditioned with -j in
+ * a pipeline of three threads so that waiting to read or write overlaps
+ * with conditioning: a reader fills input buffers, the calling thread
+ * conditions each into a list of output spans (as a part for -j, runs
+ * that need no change point into the input) and a writer writes them.
+ * Each slot goes round reader, conditioner, writer and back in order, so
+ * each hand on is from one thread to one other, with a semaphore
+ * counting the slots ready (no lock is taken unless a thread has to
+ * wait). Output and messages are the same as for one thread.
+ */
+typedef struct pipeSlot {
+  unsigned char* buf;             /* IN_BUF_SIZE of input */
+  size_t len;                     /* 0 at the end of input */
+  part out;                       /* output spans, map is buf */
+} pipeSlot;
+
+typedef struct pipeline {
+  condContext* ctx;
+  int fd;
+  pipeSlot slots[PIPE_SLOTS];
+  sem_t filled;                   /* slots read, for the conditioner */
+  sem_t conditioned;              /* slots conditioned, for the writer */
+  sem_t written;                  /* slots free again, for the reader */
+  int readError;                  /* errno of a read failure */
+} pipeline;
+
+void* pipeReader(void* arg) {
+  pipeline* p=(pipeline*)arg;
+  pipeSlot* slot;
+  ssize_t n;
+  int k;
+
+  for (k=1; ; k=(k+1)%PIPE_SLOTS) { /* slot 0 has the first input */
+    sem_wait(&p->written);
+    slot=&p->slots[k];
+    while ((n=read(p->fd,slot->buf,IN_BUF_SIZE))<0 && errno==EINTR);
+    if (n<0) {
+      p->readError=errno;
+    }
+    slot->len=(n>0 ? (size_t)n : 0);
+    sem_post(&p->filled);
+    if (n<=0) {
+      return(NULL);
+    }
+  }
+}
+
+void* pipeWriter(void* arg) {
+  pipeline* p=(pipeline*)arg;
+  condContext ctx=*p->ctx;        /* writes to the output, not a slot */
+  pipeSlot* slot;
+  size_t j, pool;
+  int k, end;
+
+  ctx.stage=NULL;
+  for (k=0; ; k=(k+1)%PIPE_SLOTS) {
+    sem_wait(&p->conditioned);
+    slot=&p->slots[k];
+    for (j=0, pool=0; j<slot->out.nspans; j++) {
+      if (slot->out.spans[j].s!=NULL) {
+        writeOutput(&ctx,slot->out.spans[j].s,slot->out.spans[j].n);
+      } else {
+        writeOutput(&ctx,slot->out.pool+pool,slot->out.spans[j].n);
+        pool+=slot->out.spans[j].n;
+      }
+    }
+    flushOutput(ctx.out);
+    slot->out.nspans=0;
+    slot->out.npool=0;
+    end=(slot->len==0);
+    sem_post(&p->written);
+    if (end) {
+      return(NULL);
+    }
+  }
+}
+
+int conditionPipelined(utf8cond* cond, int fd, const unsigned char* in, size_t n, condContext* ctx) {
+  pipeline p;
+  pipeSlot* slot;
+  pthread_t reader, writer;
+  int k, end, numErrors=0;
+
+  memset(&p,0,sizeof(p));
+  p.ctx=ctx;
+  p.fd=fd;
+  for (k=0; k<PIPE_SLOTS; k++) {
+    if ((p.slots[k].buf=(unsigned char*)malloc(IN_BUF_SIZE))==NULL) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+    p.slots[k].out.map=p.slots[k].buf;
+  }
+  memcpy(p.slots[0].buf,in,n);
+  p.slots[0].len=n;
+  sem_init(&p.filled,0,1);
+  sem_init(&p.conditioned,0,0);
+  sem_init(&p.written,0,PIPE_SLOTS-1);
+  if (pthread_create(&reader,NULL,pipeReader,&p)!=0 ||
+      pthread_create(&writer,NULL,pipeWriter,&p)!=0) {
+    fprintf(stderr,"Can't start threads, aborting!\n");
+    exit(1);
+  }
+  for (k=0, end=0; !end; k=(k+1)%PIPE_SLOTS) {
+    sem_wait(&p.filled);
+    slot=&p.slots[k];
+    slot->out.end=slot->len;
+    ctx->stage=&slot->out;
+    if ((end=(slot->len==0))) {
+      numErrors=utf8condFinish(cond);
+    } else {
+      utf8condFeed(cond,slot->buf,slot->len);
+    }
+    ctx->stage=NULL;
+    sem_post(&p.conditioned); /* the slot may be refilled after this */
+  }
+  pthread_join(reader,NULL);
+  pthread_join(writer,NULL);
+  if (p.readError!=0) {
+    snprintf(ctx->failure,sizeof(ctx->failure),"Read error: %s",strerror(p.readError));
+  }
+  for (k=0; k<PIPE_SLOTS; k++) {
+    free(p.slots[k].buf);
+    free(p.slots[k].out.spans);
+    free(p.slots[k].out.pool);
+  }
+  sem_destroy(&p.filled);
+  sem_destroy(&p.conditioned);
+  sem_destroy(&p.written);
+  return(numErrors);
+}
+
+
+/*
+ * Batch mode, see batchJob. Each thread has its own output spans and
+ * input buffer, messages for each file are collected in memory.
+ */
+void batchWork(void* arg, int k, int thread) {
+  batchJob* b=(batchJob*)arg;
+  batchFile* f=&b->files[k];
+  const char* name=b->names[k];
+  condContext ctx;
+
+  memset(&ctx,0,sizeof(ctx));
+  ctx.out=&b->out[thread];
+  ctx.errorsFormat=b->errorsFormat;
+  ctx.stats=(b->stats!=NULL ? &f->stats : NULL);
+  ctx.name=name;
+  ctx.input=name;
+  ctx.opt=b->opt;
+  ctx.quiet=b->quiet;
+  ctx.threads=1;
+  ctx.inBuf=b->inBuf+(size_t)thread*IN_BUF_SIZE;
+  ctx.cache=b->cache;
+  if ((ctx.err=open_memstream(&f->msgs,&f->nmsgs))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  if ((f->numErrors=conditionNamed(name,(b->outFiles!=NULL ? b->outFiles[k] : NULL),&ctx))<0 &&
+      (f->failure=strdup(ctx.failure))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  fclose(ctx.err);
+}
+
+void batchFinish(void* arg, int k) {
+  batchJob* b=(batchJob*)arg;
+  batchFile* f=&b->files[k];
+
+  fwrite(f->msgs,1,f->nmsgs,b->err);
+  free(f->msgs);
+  if (b->stats!=NULL) {
+    addStats(b->stats,&f->stats);
+  }
+  if (f->numErrors<0) {
+    fflush(b->err);
+    fprintf(stderr,"%s: %s\n",b->names[k],f->failure);
+    free(f->failure);
+    printf("failed 0 %s\n",b->names[k]);
+    b->numFailed++;
+  } else {
+    printf("%s %d %s\n",(f->numErrors>0 ? "errors" : "ok"),f->numErrors,b->names[k]);
+  }
+}
+
+static int compareOutFiles(const void* a, const void* b) {
+  return(strcmp(**(char***)a,**(char***)b));
+}
+
+/*
+ * Name the output for each file, in outDir and/or with outSuffix added.
+ * Two inputs with the same output (the same base name with -d) would
+ * overwrite each other, so that stops the run before anything is done.
+ */
+static void batchOutFiles(batchJob* b) {
+  const char* name;
+  const char* base;
+  char*** sorted;
+  int k;
+
+  if ((b->outFiles=(char**)calloc(b->nfiles+1,sizeof(char*)))==NULL ||
+      (sorted=(char***)calloc(b->nfiles+1,sizeof(char**)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  for (k=0; k<b->nfiles; k++) {
+    name=b->names[k];
+    base=(b->outDir!=NULL && strrchr(name,'/')!=NULL ? strrchr(name,'/')+1 : name);
+    if ((b->outFiles[k]=(char*)malloc((b->outDir!=NULL ? strlen(b->outDir)+1 : 0)+strlen(base)+
+                                      (b->outSuffix!=NULL ? strlen(b->outSuffix) : 0)+1))==NULL) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+    sprintf(b->outFiles[k],"%s%s%s%s",(b->outDir!=NULL ? b->outDir : ""),(b->outDir!=NULL ? "/" : ""),
+            base,(b->outSuffix!=NULL ? b->outSuffix : ""));
+    sorted[k]=&b->outFiles[k];
+  }
+  qsort(sorted,b->nfiles,sizeof(char**),compareOutFiles);
+  for (k=1; k<b->nfiles; k++) {
+    if (strcmp(*sorted[k-1],*sorted[k])==0) {
+      fprintf(stderr,"Files '%s' and '%s' would both be written to '%s', aborting!\n",
+              b->names[sorted[k-1]-b->outFiles],b->names[sorted[k]-b->outFiles],*sorted[k]);
+      exit(1);
+    }
+  }
+  free(sorted);
+}
+
+void conditionBatch(batchJob* b, int threads) {
+  int k;
+
+  if (threads>b->nfiles) {
+    threads=(b->nfiles>0 ? b->nfiles : 1);
+  }
+  if ((b->files=(batchFile*)calloc(b->nfiles+1,sizeof(batchFile)))==NULL ||
+      (b->out=(outputSpans*)calloc(threads,sizeof(outputSpans)))==NULL ||
+      (b->inBuf=(unsigned char*)malloc((size_t)threads*IN_BUF_SIZE))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  for (k=0; k<threads; k++) {
+    b->out[k].compress=b->compress;
+  }
+  if (!b->opt->checkOnly && (b->outDir!=NULL || b->outSuffix!=NULL)) {
+    batchOutFiles(b);
+  }
+  runWorkQueue(b->nfiles,threads,64*threads,batchWork,batchFinish,b);
+  fflush(stdout);
+  if (b->outFiles!=NULL) {
+    for (k=0; k<b->nfiles; k++) {
+      free(b->outFiles[k]);
+    }
+    free(b->outFiles);
+  }
+  free(b->files);
+  free(b->out);
+  free(b->inBuf);
+}
+
+
+/*
+ * Read the list of file names for -T from listFile ('-' for stdin),
+ * names are separated by sep. Returns the names given on the command
+ * line followed by those in the list, and the total in nfiles.
+ */
+char** readFileList(const char* listFile, int sep, char** names, int* nfiles) {
+  FILE* fp=(strcmp(listFile,"-")==0 ? stdin : fopen(listFile,"r"));
+  char** all;
+  size_t max=(size_t)*nfiles;
+  char* line=NULL;
+  size_t size=0;
+  ssize_t n;
+
+  if (fp==NULL) {
+    fprintf(stderr,"Can't open file list '%s': %s, aborting!\n",listFile,strerror(errno));
+    exit(1);
+  }
+  all=(char**)growArray(NULL,&max,max+1,sizeof(char*));
+  memcpy(all,names,(*nfiles)*sizeof(char*));
+  while ((n=getdelim(&line,&size,sep,fp))>0) {
+    if (line[n-1]==sep) {
+      line[--n]='\0';
+    }
+    if (n==0) {
+      continue;
+    }
+    all=(char**)growArray(all,&max,(size_t)*nfiles+1,sizeof(char*));
+    if ((all[(*nfiles)++]=strdup(line))==NULL) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+  }
+  free(line);
+  if (fp!=stdin) {
+    fclose(fp);
+  }
+  return(all);
+}
+
+
+/*
+ * Add the bad code or range first-last in s[] up to end, as given to -b.
+ * Returns 0 if it can't be parsed.
+ */
+int addBadCodes(utf8condOptions* opt, const char* s, const char* end) {
+  char str[64];
+  char* p;
+  unsigned long int first, last;
+
+  if (end-s>=(int)sizeof(str)) {
+    return(0);
+  }
+  memcpy(str,s,end-s);
+  str[end-s]='\0';
+  first=last=strtoul(str,&p,0);
+  if (p==str) {
+    return(0);
+  }
+  if (*p=='-') {
+    s=p+1;
+    last=strtoul(s,&p,0);
+    if (p==s || last<first) {
+      return(0);
+    }
+  }
+  if (*p!='\0') {
+    return(0);
+  }
+  if (!utf8condAddBadRange(opt,(unsigned int)first,(unsigned int)last)) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  return(1);
+}
+
+
+/* Add the bad codes and ranges listed in file for -B */
+void readBadCodes(utf8condOptions* opt, const char* file) {
+  FILE* fp=fopen(file,"r");
+  char line[1024];
+  char *s, *end;
+  int lineno=0;
+
+  if (fp==NULL) {
+    fprintf(stderr,"Can't open bad codes file '%s': %s, aborting!\n",file,strerror(errno));
+    exit(1);
+  }
+  while (fgets(line,sizeof(line),fp)!=NULL) {
+    lineno++;
+    if ((s=strchr(line,'#'))!=NULL) {
+      *s='\0';
+    }
+    for (s=line; *s!='\0'; s=end) {
+      for (; *s==' ' || *s=='\t' || *s=='\r' || *s=='\n' || *s==','; s++);
+      for (end=s; *end!='\0' && *end!=' ' && *end!='\t' && *end!='\r' && *end!='\n' && *end!=','; end++);
+      if (end>s && !addBadCodes(opt,s,end)) {
+        fprintf(stderr,"Bad code in '%s' line %d: '%.*s', aborting!\n",file,lineno,(int)(end-s),s);
+        exit(1);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+
+/* Add the entity names in file for --entities. If the file has any
+ * <!ENTITY declarations it is taken to be a DTD and the general (not
+ * parameter) entities declared are added, otherwise it is a list of
+ * names as for -B.
+ */
+void readEntities(utf8condOptions* opt, const char* file) {
+  FILE* fp=fopen(file,"r");
+  char* text=NULL;
+  size_t len=0, size=0, n;
+  char *s, *end;
+  int dtd;
+
+  if (fp==NULL) {
+    fprintf(stderr,"Can't open entities file '%s': %s, aborting!\n",file,strerror(errno));
+    exit(1);
+  }
+  do {
+    if (len+1>=size) {
+      size=(size==0 ? 4096 : 2*size);
+      if ((text=realloc(text,size))==NULL) {
+        fprintf(stderr,"Out of memory, aborting!\n");
+        exit(1);
+      }
+    }
+    n=fread(text+len,1,size-len-1,fp);
+    len+=n;
+  } while (n>0);
+  fclose(fp);
+  text[len]='\0';
+
+  dtd=(strstr(text,"<!ENTITY")!=NULL);
+  for (s=text; *s!='\0'; s=end) {
+    if (dtd) {
+      if ((s=strstr(s,"<!ENTITY"))==NULL) {
+        break;
+      }
+      for (s+=8; *s==' ' || *s=='\t' || *s=='\r' || *s=='\n'; s++);
+      if (*s=='%') {
+        end=s;          /* parameter entity */
+        continue;
+      }
+    } else {
+      for (; *s==' ' || *s=='\t' || *s=='\r' || *s=='\n' || *s==',' || *s=='#'; s++) {
+        if (*s=='#') {
+          for (; *s!='\0' && *s!='\n'; s++);
+          if (*s=='\0') break;
+        }
+      }
+    }
+    for (end=s; *end!='\0' && *end!=' ' && *end!='\t' && *end!='\r' && *end!='\n' &&
+                (dtd || (*end!=',' && *end!='#')); end++);
+    if (end>s && !utf8condAddEntity(opt,s,(size_t)(end-s))) {
+      fprintf(stderr,"Bad entity name in '%s': '%.*s', aborting!\n",file,(int)(end-s),s);
+      exit(1);
+    }
+  }
+  free(text);
+}
+
+
+/* Output callback, add conditioned bytes to the output spans */
+void writeOutput(void* ctx, const unsigned char* s, size_t n) {
+  outputSpans* out=((condContext*)ctx)->out;
+  struct iovec* last;
+
+  if (((condContext*)ctx)->stage!=NULL) {
+    partWrite(((condContext*)ctx)->stage,s,n);
+    return;
+  }
+  if (((condContext*)ctx)->token!=NULL) {
+    scanToken(((condContext*)ctx)->token,((condContext*)ctx)->input,s,n);
+  }
+  if (out->pass!=NULL) {
+    const unsigned char* p=out->pass+out->passed+out->npass;
+
+    if (out->passed+out->npass+n<=out->maxPass && (s==p || memcmp(s,p,n)==0)) {
+      if ((out->npass+=n)>=PASS_SIZE) {
+        copyPass(out);
+      }
+      return;
+    }
+    endPass(out); /* the first change */
+  }
+
+  /* flush first if full, flushing empties the pool so must not come
+   * between copying into it and adding the span */
+  if (out->niov==OUT_IOV || (n<OUT_SHORT && out->npool+n>OUT_POOL)) {
+    flushOutput(out);
+  }
+  last=(out->niov>0 ? &out->iov[out->niov-1] : NULL);
+  if (n<OUT_SHORT) {
+    memcpy(out->pool+out->npool,s,n);
+    s=out->pool+out->npool;
+    out->npool+=n;
+  }
+  if (last!=NULL && (unsigned char*)last->iov_base+last->iov_len==s) {
+    last->iov_len+=n; /* extends previous span */
+    return;
+  }
+  out->iov[out->niov].iov_base=(void*)s;
+  out->iov[out->niov].iov_len=n;
+  out->niov++;
+}
+
+
+#define XML_SPACE(c) ((c)==' ' || (c)=='\t' || (c)=='\n' || (c)=='\r')
+
+/* Write the token found as a line on t->fp, with runs of whitespace in
+ * the attributes and any control characters in the token as a space */
+static void printToken(tokenScan* t, const char* input) {
+  size_t j, start=0, end=t->ntoken;
+  int space=0, any=0;
+
+  while (start<end && XML_SPACE(t->token[start])) start++;
+  while (end>start && XML_SPACE(t->token[end-1])) end--;
+  fprintf(t->fp,"%s\t",input);
+  for (j=start; j<end; j++) {
+    putc(((unsigned char)t->token[j]<0x20 ? ' ' : t->token[j]),t->fp);
+  }
+  putc('\t',t->fp);
+  for (j=0; j<t->nattr; j++) {
+    if (XML_SPACE(t->attr[j])) {
+      space=any;
+    } else {
+      if (space) {
+        putc(' ',t->fp);
+        space=0;
+      }
+      putc(t->attr[j],t->fp);
+      any=1;
+    }
+  }
+  putc('\n',t->fp);
+  fflush(t->fp); /* the harvester may be waiting for it */
+}
+
+/* Look for a resumptionToken element in the n bytes of output at s,
+ * carrying on from where the last call got to, see tokenScan */
+void scanToken(tokenScan* t, const char* input, const unsigned char* s, size_t n) {
+  static const char name[]="resumptionToken";
+  static const char endTag[]="/resumptionToken";
+  const unsigned char* end=s+n;
+  const unsigned char* p;
+  size_t k;
+
+  while (s<end) {
+    switch (t->state) {
+      case TOKEN_OUT:
+        if ((p=(const unsigned char*)memchr(s,'<',(size_t)(end-s)))==NULL) {
+          return;
+        }
+        s=p+1;
+        t->state=TOKEN_NAME;
+        t->matched=0;
+        break;
+      case TOKEN_NAME:
+        /* bytes that don't match are looked at again as they may be '<' */
+        if (t->matched<sizeof(name)-1) {
+          if (*s!=(unsigned char)name[t->matched]) {
+            t->state=TOKEN_OUT;
+          } else {
+            t->matched++;
+            s++;
+          }
+        } else if (*s=='>' || *s=='/' || XML_SPACE(*s)) {
+          t->state=TOKEN_ATTR;
+          t->nattr=0;
+          t->ntoken=0;
+          t->quote=0;
+        } else {
+          t->state=TOKEN_OUT;
+        }
+        break;
+      case TOKEN_ATTR:
+        if (*s=='>' && t->quote==0) {
+          s++;
+          if (t->nattr>0 && t->attr[t->nattr-1]=='/') {
+            t->nattr--; /* empty element, the list is complete */
+            printToken(t,input);
+            t->state=TOKEN_OUT;
+          } else {
+            t->state=TOKEN_TEXT;
+          }
+        } else if (t->nattr==TOKEN_MAX) {
+          t->state=TOKEN_OUT;
+        } else {
+          if (*s==t->quote) {
+            t->quote=0;
+          } else if (t->quote==0 && (*s=='"' || *s=='\'')) {
+            t->quote=*s;
+          }
+          t->attr[t->nattr++]=(char)*s++;
+        }
+        break;
+      case TOKEN_TEXT:
+        p=(const unsigned char*)memchr(s,'<',(size_t)(end-s));
+        k=(size_t)((p!=NULL ? p : end)-s);
+        if (t->ntoken+k>TOKEN_MAX) {
+          t->state=TOKEN_OUT;
+          break;
+        }
+        memcpy(t->token+t->ntoken,s,k);
+        t->ntoken+=k;
+        s+=k;
+        if (p!=NULL) {
+          s++;
+          t->state=TOKEN_END;
+          t->matched=0;
+        }
+        break;
+      case TOKEN_END:
+        if (t->matched<sizeof(endTag)-1) {
+          if (*s!=(unsigned char)endTag[t->matched]) {
+            t->state=TOKEN_OUT;
+          } else {
+            t->matched++;
+            s++;
+          }
+        } else if (XML_SPACE(*s)) {
+          s++;
+        } else {
+          if (*s=='>') {
+            s++;
+            printToken(t,input);
+          }
+          t->state=TOKEN_OUT;
+        }
+        break;
+    }
+  }
+}
+
+
+/* Write all of the n bytes at s */
+static void writeAll(outputSpans* out, const unsigned char* s, size_t n) {
+  ssize_t w;
+
+  while (n>0 && out->error==0) {
+    if ((w=write(out->fd,s,n))<0) {
+      if (errno!=EINTR) {
+        out->error=errno;
+      }
+      continue;
+    }
+    s+=w;
+    n-=(size_t)w;
+  }
+}
+
+/* Deflate the n bytes at s (with flush Z_NO_FLUSH or Z_FINISH) and
+ * write whatever is ready */
+static void deflateOutput(outputSpans* out, const unsigned char* s, size_t n, int flush) {
+  int ret;
+
+  if (!out->zstarted) {
+    memset(&out->z,0,sizeof(out->z));
+    if (deflateInit2(&out->z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)!=Z_OK) {
+      fprintf(stderr,"Out of memory, aborting!\n");
+      exit(1);
+    }
+    out->zstarted=1;
+  }
+  out->z.next_in=(unsigned char*)s;
+  out->z.avail_in=(uInt)n;
+  do {
+    out->z.next_out=out->zbuf;
+    out->z.avail_out=Z_BUF_SIZE;
+    ret=deflate(&out->z,flush);
+    writeAll(out,out->zbuf,Z_BUF_SIZE-out->z.avail_out);
+  } while (out->z.avail_out==0 || (flush==Z_FINISH && ret!=Z_STREAM_END));
+}
+
+/* Write all gathered output spans */
+void flushOutput(outputSpans* out) {
+  struct iovec* iov=out->iov;
+  int niov=out->niov;
+  ssize_t n;
+
+  if (out->compress) {
+    for (; niov>0 && out->error==0; iov++, niov--) {
+      deflateOutput(out,(const unsigned char*)iov->iov_base,iov->iov_len,Z_NO_FLUSH);
+    }
+    niov=0;
+  }
+  while (niov>0 && out->error==0) {
+    if ((n=writev(out->fd,iov,(niov<IOV_MAX ? niov : IOV_MAX)))<0) {
+      if (errno!=EINTR) {
+        out->error=errno;
+      }
+      continue;
+    }
+    /* skip whatever was written, writev() may stop part way */
+    while (niov>0 && (size_t)n>=iov->iov_len) {
+      n-=iov->iov_len;
+      iov++; niov--;
+    }
+    if (niov>0) {
+      iov->iov_base=(unsigned char*)iov->iov_base+n;
+      iov->iov_len-=n;
+    }
+  }
+  out->niov=0;
+  out->npool=0;
+}
+
+
+/*
+ * Output of a mapped file is held back while it is the same as the
+ * input, as it is for most files, and then copied by the kernel with
+ * copy_file_range() (or sendfile() to a pipe or socket) rather than
+ * written from user space. From the first change on, output is written
+ * as usual after the input before it. Not used with -z.
+ */
+void startPass(outputSpans* out, int fd, const unsigned char* map, size_t len) {
+  if (out->compress || out->fd<0) {
+    return;
+  }
+  flushOutput(out);
+  out->pass=map;
+  out->passed=0;
+  out->npass=0;
+  out->maxPass=len;
+  out->passFd=fd;
+}
+
+/* Write the input held back so far, in pieces so output to a pipe
+ * isn't all left to the end */
+void copyPass(outputSpans* out) {
+  off_t off=(off_t)out->passed;
+  size_t n=out->npass;
+  ssize_t w;
+  int how=0;                      /* copy_file_range(), sendfile(), write() */
+
+  while (n>0 && out->error==0 && how<2) {
+    w=(how==0 ? copy_file_range(out->passFd,&off,out->fd,NULL,n,0) :
+                sendfile(out->fd,out->passFd,&off,n));
+    if (w>0) {
+      n-=(size_t)w;
+    } else if (w==0 || errno!=EINTR) {
+      how++; /* not for these files, try the next way */
+    }
+  }
+  writeAll(out,out->pass+off,n);
+  out->passed+=out->npass;
+  out->npass=0;
+}
+
+/* Write the input held back and stop holding back */
+void endPass(outputSpans* out) {
+  if (out->pass!=NULL) {
+    copyPass(out);
+    out->pass=NULL;
+  }
+}
+
+
+/* End the output, with -z this writes the end of the gzip stream */
+void finishOutput(outputSpans* out) {
+  flushOutput(out);
+  if (out->compress) {
+    deflateOutput(out,NULL,0,Z_FINISH);
+    deflateEnd(&out->z);
+    out->zstarted=0;
+  }
+}
+
+
+/*
+ * Take the long options out of argv, filling in lo. Options with values
+ * may be given as --opt=value or --opt value. Returns the number of
+ * arguments left.
+ */
+int longOptions(int argc, char* argv[], longOpts* lo) {
+  int j, k=1;
+  const char* name;
+  const char* value;
+  size_t len;
+
+  for (j=1; j<argc && strcmp(argv[j],"--")!=0; j++) {
+    if (strncmp(argv[j],"--",2)!=0) {
+      argv[k++]=argv[j];
+      continue;
+    }
+    name=argv[j];
+    len=strcspn(name,"=");
+    value=(name[len]=='=' ? name+len+1 : NULL);
+    if (len==7 && strncmp(name,"--stats",len)==0) {
+      /* value is optional */
+      if (value==NULL || strcmp(value,"text")==0) {
+        lo->stats=STATS_TEXT;
+      } else if (strcmp(value,"json")==0) {
+        lo->stats=STATS_JSON;
+      } else {
+        fprintf(stderr,"Bad value for --stats: '%s', aborting!\n",value);
+        exit(1);
+      }
+      continue;
+    }
+    if (value==NULL) {
+      if (j+1>=argc) {
+        fprintf(stderr,"Missing value for %s, aborting!\n",name);
+        exit(1);
+      }
+      value=argv[++j];
+    }
+    if (len==15 && strncmp(name,"--errors-format",len)==0) {
+      if (strcmp(value,"text")==0) {
+        lo->errorsFormat=ERRORS_TEXT;
+      } else if (strcmp(value,"jsonl")==0) {
+        lo->errorsFormat=ERRORS_JSONL;
+      } else if (strcmp(value,"csv")==0) {
+        lo->errorsFormat=ERRORS_CSV;
+      } else {
+        fprintf(stderr,"Bad value for --errors-format: '%s', aborting!\n",value);
+        exit(1);
+      }
+    } else if (len==12 && strncmp(name,"--errors-out",len)==0) {
+      lo->errorsOut=value;
+    } else if (len==10 && strncmp(name,"--entities",len)==0) {
+      lo->entities=value;
+    } else if (len==7 && strncmp(name,"--cache",len)==0) {
+      lo->cache=value;
+    } else if (len==12 && strncmp(name,"--checkpoint",len)==0) {
+      lo->checkpoint=value;
+    } else if (len==7 && strncmp(name,"--serve",len)==0) {
+      lo->serve=value;
+    } else if (len==8 && strncmp(name,"--repair",len)==0) {
+      lo->repair=value;
+    } else if (len==15 && strncmp(name,"--extract-token",len)==0) {
+      lo->extractToken=value;
+    } else if (len==9 && strncmp(name,"--records",len)==0) {
+      if (strcmp(value,"nul")==0) {
+        lo->records=RECORDS_NUL;
+      } else if (strcmp(value,"length")==0) {
+        lo->records=RECORDS_LENGTH;
+      } else {
+        fprintf(stderr,"Bad value for --records: '%s', aborting!\n",value);
+        exit(1);
+      }
+    } else {
+      fprintf(stderr,"Unknown option '%.*s', aborting!\n",(int)len,name);
+      exit(1);
+    }
+  }
+  for (; j<argc; j++) {
+    argv[k++]=argv[j];
+  }
+  argv[k]=NULL;
+  return(k);
+}
+
+
+/* Length of the valid UTF-8 character (not overlong, a surrogate or
+ * above 0x10FFFF) starting with the byte from 0x80 at s, or 0 if none */
+static int utf8CharLen(const unsigned char* s) {
+  int n, j;
+  unsigned int u;
+
+  if (s[0]>=0xC2 && s[0]<=0xDF) {
+    n=2;
+  } else if (s[0]>=0xE0 && s[0]<=0xEF) {
+    n=3;
+  } else if (s[0]>=0xF0 && s[0]<=0xF4) {
+    n=4;
+  } else {
+    return(0);
+  }
+  u=s[0]&(0x7F>>n);
+  for (j=1; j<n; j++) {
+    if ((s[j]&0xC0)!=0x80) {
+      return(0);
+    }
+    u=(u<<6)|(s[j]&0x3F);
+  }
+  if ((n==3 && (u<0x800 || (u>=0xD800 && u<=0xDFFF))) || (n==4 && (u<0x10000 || u>0x10FFFF))) {
+    return(0);
+  }
+  return(n);
+}
+
+/* Write s as a JSON string, bytes that aren't valid UTF-8 (a file name
+ * perhaps) as U+FFFD so the line is always valid JSON */
+void jsonString(FILE* fp, const char* s) {
+  int n;
+
+  putc('"',fp);
+  while (*s!='\0') {
+    if (*s=='"' || *s=='\\') {
+      putc('\\',fp);
+      putc(*s++,fp);
+    } else if ((unsigned char)*s<0x20) {
+      fprintf(fp,"\\u%04X",(unsigned char)*s++);
+    } else if ((unsigned char)*s<0x80) {
+      putc(*s++,fp);
+    } else if ((n=utf8CharLen((const unsigned char*)s))>0) {
+      fwrite(s,1,n,fp);
+      s+=n;
+    } else {
+      fprintf(fp,"\\uFFFD");
+      s++;
+    }
+  }
+  putc('"',fp);
+}
+
+/* Write s as a CSV field, quoted */
+void csvString(FILE* fp, const char* s) {
+  putc('"',fp);
+  for (; *s!='\0'; s++) {
+    if (*s=='"') {
+      putc('"',fp);
+    }
+    putc(*s,fp);
+  }
+  putc('"',fp);
+}
+
+/* Write n bytes as hex digits */
+void hexBytes(FILE* fp, const unsigned char* b, int n) {
+  static const char hex[]="0123456789ABCDEF";
+  int j;
+  for (j=0; j<n; j++) {
+    putc(hex[b[j]>>4],fp);
+    putc(hex[b[j]&0xF],fp);
+  }
+}
+
+void printErrorsHeader(FILE* err, int errorsFormat) {
+  if (errorsFormat==ERRORS_CSV) {
+    fprintf(err,"file,line,char,byte,kind,error,code,bytes,replacement,message\n");
+  }
+}
+
+/*
+ * Error callback, report error on err (stderr, the --errors-out file or
+ * the batch mode messages). The message text is only made here, the
+ * library reports a record of the error.
+ */
+void printError(void* ctx, const utf8condError* e) {
+  condContext* c=(condContext*)ctx;
+  char msg[1024];
+
+  if (e->byte<=c->reported) {
+    return;
+  }
+  utf8condErrorText(e,msg,sizeof(msg));
+  if (c->errorsFormat==ERRORS_JSONL) {
+    fprintf(c->err,"{\"file\":");
+    jsonString(c->err,c->input);
+    fprintf(c->err,",\"line\":%llu,\"char\":%llu,\"byte\":%llu,\"kind\":\"%s\",\"error\":%s,\"code\":",
+            e->line,e->chr,e->byte,utf8condErrorKind(e->part[0].kind),(e->isError ? "true" : "false"));
+    if (e->code>=0) {
+      fprintf(c->err,"%ld",e->code);
+    } else {
+      fprintf(c->err,"null");
+    }
+    fprintf(c->err,",\"bytes\":\"");
+    hexBytes(c->err,e->bytes,(e->nbytes<UTF8COND_MAX_BYTES ? e->nbytes : UTF8COND_MAX_BYTES));
+    fprintf(c->err,"\",\"replacement\":\"");
+    hexBytes(c->err,e->repl,e->nrepl);
+    fprintf(c->err,"\",\"message\":");
+    jsonString(c->err,msg);
+    fprintf(c->err,"}\n");
+  } else if (c->errorsFormat==ERRORS_CSV) {
+    csvString(c->err,c->input);
+    fprintf(c->err,",%llu,%llu,%llu,%s,%d,",e->line,e->chr,e->byte,utf8condErrorKind(e->part[0].kind),e->isError);
+    if (e->code>=0) {
+      fprintf(c->err,"%ld",e->code);
+    }
+    putc(',',c->err);
+    hexBytes(c->err,e->bytes,(e->nbytes<UTF8COND_MAX_BYTES ? e->nbytes : UTF8COND_MAX_BYTES));
+    putc(',',c->err);
+    hexBytes(c->err,e->repl,e->nrepl);
+    putc(',',c->err);
+    csvString(c->err,msg);
+    putc('\n',c->err);
+  } else {
+    if (c->name!=NULL) {
+      fprintf(c->err,"%s: ",c->name);
+    }
+    fprintf(c->err,"Line %llu, char %llu, byte %llu: %s\n", e->line, e->chr, e->byte, msg);
+  }
+}
+
+/* Add stats for one file, or part of one, to total */
+void addStats(utf8condStats* total, const utf8condStats* stats) {
+  int j;
+
+  total->bytes+=stats->bytes;
+  total->chars+=stats->chars;
+  total->lines+=stats->lines;
+  for (j=0; j<UTF8COND_NUM_KINDS; j++) {
+    total->errors[j]+=stats->errors[j];
+  }
+  for (j=0; j<7; j++) {
+    total->charBytes[j]+=stats->charBytes[j];
+  }
+  total->entities+=stats->entities;
+  total->fastBytes+=stats->fastBytes;
+  total->slowBytes+=stats->slowBytes;
+  total->fastSeconds+=stats->fastSeconds;
+  total->slowSeconds+=stats->slowSeconds;
+}
+
+/*
+ * Write the stats for --stats, secs is the time for the whole run. Fast
+ * and slow path times are summed over threads with -j. All the counts
+ * are always given, in the same order, so the output is easy to compare.
+ */
+void printStats(FILE* fp, int format, const utf8condStats* stats, double secs) {
+  double rate=(secs>0 ? stats->bytes/secs : 0.0);
+  int j;
+
+  if (format==STATS_JSON) {
+    fprintf(fp,"{\"bytes\":%llu,\"chars\":%llu,\"lines\":%llu,\"seconds\":%.6f,\"bytes_per_second\":%.0f,"
+            "\"fast_bytes\":%llu,\"fast_seconds\":%.6f,\"slow_bytes\":%llu,\"slow_seconds\":%.6f,\"char_bytes\":[",
+            stats->bytes,stats->chars,stats->lines,secs,rate,
+            stats->fastBytes,stats->fastSeconds,stats->slowBytes,stats->slowSeconds);
+    for (j=1; j<7; j++) {
+      fprintf(fp,"%s%llu",(j>1 ? "," : ""),stats->charBytes[j]);
+    }
+    fprintf(fp,"],\"entities\":%llu,\"errors\":{",stats->entities);
+    for (j=0; j<UTF8COND_NUM_KINDS; j++) {
+      fprintf(fp,"%s\"%s\":%llu",(j>0 ? "," : ""),utf8condErrorKind(j),stats->errors[j]);
+    }
+    fprintf(fp,"}}\n");
+  } else {
+    fprintf(fp,"Bytes: %llu\nChars: %llu\nLines: %llu\n",stats->bytes,stats->chars,stats->lines);
+    fprintf(fp,"Time: %.6f s, %.1f MB/s\n",secs,rate/1e6);
+    fprintf(fp,"Fast path: %llu bytes, %.6f s\n",stats->fastBytes,stats->fastSeconds);
+    fprintf(fp,"Slow path: %llu bytes, %.6f s\n",stats->slowBytes,stats->slowSeconds);
+    fprintf(fp,"Slow path chars by bytes:");
+    for (j=1; j<7; j++) {
+      fprintf(fp," %d:%llu",j,stats->charBytes[j]);
+    }
+    fprintf(fp,"\nEntity references: %llu\nErrors:",stats->entities);
+    for (j=0; j<UTF8COND_NUM_KINDS; j++) {
+      fprintf(fp," %s:%llu",utf8condErrorKind(j),stats->errors[j]);
+    }
+    fprintf(fp,"\n");
+  }
+  fflush(fp);
+}
+
+/* Report that n more errors were found than -e allows to be reported */
+void printUnreported(condContext* c, int n) {
+  if (c->errorsFormat==ERRORS_JSONL) {
+    fprintf(c->err,"{\"file\":");
+    jsonString(c->err,c->input);
+    fprintf(c->err,",\"kind\":\"not-reported\",\"count\":%d}\n",n);
+  } else if (c->errorsFormat==ERRORS_CSV) {
+    csvString(c->err,c->input);
+    fprintf(c->err,",,,,not-reported,1,,,,\"%d additional errors not reported.\"\n",n);
+  } else {
+    if (c->name!=NULL) {
+      fprintf(c->err,"%s: ",c->name);
+    }
+    fprintf(c->err,"%d additional errors not reported.\n",n);
+  }
+}
+
+/* Wall clock time in seconds, for --stats */
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return(ts.tv_sec+ts.tv_nsec/1e9);
 }
 
 /***end***/
@@ -0,0 +1,101 @@
+/* Ordered work queue for utf8conditioner
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * See workqueue.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "workqueue.h"
+
+typedef struct workQueue {
+  int n;
+  int next;                       /* next job to start */
+  int finished;                   /* jobs finished so far */
+  int ahead;
+  char* done;                     /* done[k] true once job k is done */
+  workFn work;
+  void* arg;
+  int nthreads;                   /* threads started, for thread numbers */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} workQueue;
+
+static void* worker(void* a) {
+  workQueue* q=(workQueue*)a;
+  int k, thread;
+
+  pthread_mutex_lock(&q->lock);
+  thread=q->nthreads++;
+  for (;;) {
+    while (q->next<q->n && q->next>=q->finished+q->ahead) {
+      pthread_cond_wait(&q->changed,&q->lock);
+    }
+    if (q->next>=q->n) {
+      pthread_mutex_unlock(&q->lock);
+      return(NULL);
+    }
+    k=q->next++;
+    pthread_mutex_unlock(&q->lock);
+
+    q->work(q->arg,k,thread);
+
+    pthread_mutex_lock(&q->lock);
+    q->done[k]=1;
+    pthread_cond_broadcast(&q->changed);
+  }
+}
+
+void runWorkQueue(int n, int threads, int ahead, workFn work, finishFn finish, void* arg) {
+  workQueue q;
+  pthread_t* tids;
+  int j, k;
+
+  q.n=n;
+  q.next=0;
+  q.finished=0;
+  q.ahead=(ahead<threads ? threads : ahead);
+  q.work=work;
+  q.arg=arg;
+  q.nthreads=0;
+  if ((q.done=(char*)calloc(n+1,1))==NULL ||
+      (tids=(pthread_t*)malloc(threads*sizeof(pthread_t)))==NULL) {
+    fprintf(stderr,"Out of memory, aborting!\n");
+    exit(1);
+  }
+  pthread_mutex_init(&q.lock,NULL);
+  pthread_cond_init(&q.changed,NULL);
+  for (j=0; j<threads; j++) {
+    if (pthread_create(&tids[j],NULL,worker,&q)!=0) {
+      fprintf(stderr,"Can't start thread, aborting!\n");
+      exit(1);
+    }
+  }
+
+  for (k=0; k<n; k++) {
+    pthread_mutex_lock(&q.lock);
+    while (!q.done[k]) {
+      pthread_cond_wait(&q.changed,&q.lock);
+    }
+    pthread_mutex_unlock(&q.lock);
+
+    finish(arg,k);
+
+    pthread_mutex_lock(&q.lock);
+    q.finished++;
+    pthread_cond_broadcast(&q.changed);
+    pthread_mutex_unlock(&q.lock);
+  }
+
+  for (j=0; j<threads; j++) {
+    pthread_join(tids[j],NULL);
+  }
+  pthread_mutex_destroy(&q.lock);
+  pthread_cond_destroy(&q.changed);
+  free(tids);
+  free(q.done);
+}
@@ -0,0 +1,24 @@
+/* Ordered work queue for utf8conditioner
+ * Copyright (C) 2001-2005 Simeon Warner - simeon@cs.cornell.edu
+ *
+ * utf8conditioner is supplied under the GNU Public License and comes
+ * with ABSOLUTELY NO WARRANTY; see COPYING for more details.
+ *
+ * runWorkQueue() calls work(arg,k,thread) for each job k from 0 to n-1
+ * on a pool of threads (thread is the number of the thread, 0 to
+ * threads-1, for per-thread buffers). Each idle thread takes the next
+ * job so that a few slow jobs don't hold up the rest. The calling thread
+ * calls finish(arg,k) for each job in order as soon as it is done, and
+ * jobs are not started more than ahead jobs beyond the last finished so
+ * the results waiting to be finished are limited.
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+typedef void (*workFn)(void* arg, int k, int thread);
+typedef void (*finishFn)(void* arg, int k);
+
+void runWorkQueue(int n, int threads, int ahead, workFn work, finishFn finish, void* arg);
+
+#endif